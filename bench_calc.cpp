@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2016 Walter William Karas
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+  benchmark for evaluation of numeric expressions.  prints the number
+  of calls of calc() per second for an expression evaluated
+  repeatedly, for a set of expressions larger than the cache of
+  compiled expressions, for expressions which are all different, and
+  for an expression with names, whose values change.
+
+  build with:
+
+    g++ -std=c++11 -O2 -o bench_calc bench_calc.cpp calc.cpp
+
+  usage:
+
+    bench_calc [number of calls in millions]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "calc.h"
+
+/* sum of results, printed so the calls are not optimized away */
+static long int total;
+
+/* values of the names i and m */
+static long int name_i,name_m;
+
+/*
+  get the value of a name
+*/
+static const char *name_value
+  (
+    void *data,
+    const char *name,
+    size_t len,
+    long int *value
+  )
+  {
+    (void) data;
+
+    if ((len == 1) && (*name == 'i'))
+      *value = name_i++;
+    else if ((len == 1) && (*name == 'm'))
+      *value = name_m;
+    else
+      return("unknown name");
+
+    return((const char *) 0);
+  }
+
+/*
+  evaluate the expressions in turn, until n calls have been made.
+  returns calls per second.
+*/
+static double run
+  (
+    const std::vector<std::string> &expr,
+    size_t n
+  )
+  {
+    const char *msg;
+    long int r;
+    size_t i;
+
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (i = 0; i < n; i++)
+      {
+        msg = calc(expr[i % expr.size()].c_str(),&r,name_value,
+                   (void *) 0);
+        if (msg != (const char *) 0)
+          {
+            fprintf(stderr,"%s\n",msg);
+            exit(1);
+          }
+        total += r;
+      }
+
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+    return(double(n) / d.count());
+  }
+
+/*
+  make expressions like those if and loop conditions expand into
+*/
+static void make_expr
+  (
+    std::vector<std::string> &expr,
+    size_t n
+  )
+  {
+    size_t i;
+
+
+    for (i = 0; i < n; i++)
+      expr.push_back("(" + std::to_string(i) + " + 1) * 2 <= " +
+                     std::to_string(i % 97) + " * 40 and not " +
+                     std::to_string(i % 7) + " = 3");
+  }
+
+int main
+  (
+    int argc,
+    const char **argv
+  )
+  {
+    size_t n = 4;
+    std::vector<std::string> one,many,distinct,names;
+
+
+    if (argc > 1)
+      n = size_t(atol(argv[1]));
+    n *= 1000000;
+
+    make_expr(one,1);
+    make_expr(many,1000);
+    make_expr(distinct,n);
+    names.push_back("(i + 1) * 2 <= m * 40 and not i mod 7 = 3");
+    name_m = 50;
+
+    /* warm up, then measure */
+    (void) run(one,n / 10);
+    printf("%-10s %12.0f calls/s\n","repeated",run(one,n));
+    printf("%-10s %12.0f calls/s\n","set",run(many,n));
+    printf("%-10s %12.0f calls/s\n","distinct",run(distinct,n));
+    printf("%-10s %12.0f calls/s\n","names",run(names,n));
+
+    return(total == 42);
+  }
@@ -0,0 +1,184 @@
+/*
+Copyright (c) 2016 Walter William Karas
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+  benchmark for inlining of small macros.  expands text which invokes
+  wrapper macros (macros whose bodies invoke other small macros with
+  their arguments), in a context whose definitions are made directly,
+  and in a context derived from a frozen context with the same
+  definitions, where the wrappers are inlined.  prints the number of
+  macro invocations per byte of output, and the throughput in megabytes
+  of output per second.
+
+  build with:
+
+    g++ -std=c++11 -O2 -o bench_inline bench_inline.cpp macro.cpp scan.cpp \
+      crc.cpp
+
+  usage:
+
+    bench_inline [size of output in megabytes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include "macro.h"
+
+/* the definitions, name followed by body */
+static const char * const defs[] =
+  {
+    "b", "<b>$(1)</b>",
+    "i", "<i>$(1)</i>",
+    "bi", "$(b !$(i !$(1)!)!)",
+    "link", "<a href=\"$(1)\">$(2)</a>",
+    "item", "<li>$(link !$(1).html! !$(bi !$(2)!)!)</li>",
+    "pair", "$(item !$(1)! !$(2)!)$(item !$(2)! !$(1)!)",
+    (const char *) 0
+  };
+
+/* a line of input */
+static const char line[] =
+  "$(pair !intro! !start here!) $(item !faq! !questions!) $(b !note!)\n";
+
+/* number of bytes of output */
+static size_t n_out;
+
+/*
+  count the bytes of output, which is otherwise discarded
+*/
+static const char *count_out
+  (
+    void *data,
+    const char *text,
+    size_t len
+  )
+  {
+    (void) data;
+    (void) text;
+
+    n_out += len;
+
+    return((const char *) 0);
+  }
+
+/*
+  define the macros in a context
+*/
+static void define
+  (
+    Mcr_context *ctx
+  )
+  {
+    const char *msg;
+    int i;
+
+
+    for (i = 0; defs[i] != (const char *) 0; i += 2)
+      {
+        msg = mcr_def(ctx,defs[i],(void *) defs[i + 1],1);
+        if (msg != (const char *) 0)
+          {
+            fprintf(stderr,"%s\n",msg);
+            exit(1);
+          }
+      }
+  }
+
+/*
+  expand the input.  if title is not null, print the invocations per
+  byte of output and the throughput.
+*/
+static void run
+  (
+    const char *title,
+    Mcr_context *ctx,
+    const std::string &text
+  )
+  {
+    unsigned long int n_invoked = mcr_n_invoked(ctx);
+    const char *p = text.data(), *end = p + text.size(), *msg;
+    size_t n_used;
+
+
+    (void) mcr_sink_func(ctx,count_out,(void *) 0);
+    n_out = 0;
+
+    mcr_start_expand(ctx,0,(const char **) 0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (msg = (const char *) 0; (p != end) && (msg == (const char *) 0);
+         p += n_used)
+      msg = mcr_next_chars(ctx,p,size_t(end - p),&n_used);
+    if (msg == (const char *) 0)
+      msg = mcr_flush_sink(ctx);
+    if (msg != (const char *) 0)
+      {
+        fprintf(stderr,"%s\n",msg);
+        exit(1);
+      }
+
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+    if (title != (const char *) 0)
+      printf("%-8s %8.4f invocations/byte %10.1f MB/s\n",title,
+             double(mcr_n_invoked(ctx) - n_invoked) / double(n_out),
+             double(n_out) / (1024.0 * 1024.0) / d.count());
+  }
+
+int main
+  (
+    int argc,
+    const char **argv
+  )
+  {
+    size_t size = 64;
+    std::string text;
+    Mcr_context *plain = mcr_new_context();
+    Mcr_context *base = mcr_new_context();
+    Mcr_context *derived;
+
+
+    if (argc > 1)
+      size = size_t(atol(argv[1]));
+
+    /* the output is about five times the size of the input */
+    while (text.size() < size * 1024 * 1024 / 5)
+      text += line;
+
+    define(plain);
+    define(base);
+    mcr_freeze(base);
+    derived = mcr_new_derived_context(base);
+
+    /* warm up, then measure */
+    run((const char *) 0,plain,text);
+    run("plain",plain,text);
+    run((const char *) 0,derived,text);
+    run("inlined",derived,text);
+
+    mcr_delete_context(derived);
+    mcr_delete_context(base);
+    mcr_delete_context(plain);
+
+    return(0);
+  }
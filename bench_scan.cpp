@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2016 Walter William Karas
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+  benchmark for scanning of literal text by the macro processor.
+  expands a large input consisting mostly of text with no macro
+  invocations, using each implementation of scan_delim the processor
+  supports, and prints the throughput in megabytes per second.
+
+  build with:
+
+    g++ -std=c++11 -O2 -o bench_scan bench_scan.cpp macro.cpp scan.cpp crc.cpp
+
+  usage:
+
+    bench_scan [size of input in megabytes] [length of spans]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "macro.h"
+#include "scan.h"
+
+static const char * const impl_name[] = { "scalar", "sse2", "avx2" };
+
+/*
+  create input text.  one line in fifty contains a macro invocation.
+*/
+static void make_input
+  (
+    std::vector<char> &text,
+    size_t size
+  )
+  {
+    static const char lit_line[] =
+      "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+      "eiusmod tempor incididunt ut labore et dolore magna aliqua.\n";
+    static const char mcr_line[] =
+      "Ut enim ad minim veniam, $(quis) nostrud exercitation.\n";
+
+    int i = 0;
+
+
+    while (text.size() < size)
+      {
+        const char *line = (++i % 50) ? lit_line : mcr_line;
+
+        text.insert(text.end(),line,line + strlen(line));
+      }
+  }
+
+/*
+  expand text, feeding it to the macro processor in spans of the given
+  length.  returns seconds taken.
+*/
+static double run
+  (
+    Mcr_context *ctx,
+    const std::vector<char> &text,
+    size_t span_len
+  )
+  {
+    const char *p = text.data(), *end = p + text.size(), *msg;
+    size_t n,n_used;
+
+
+    mcr_start_expand(ctx,0,(const char **) 0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (p != end)
+      {
+        n = size_t(end - p);
+        if (n > span_len)
+          n = span_len;
+
+        msg = mcr_next_chars(ctx,p,n,&n_used);
+        if (msg != (const char *) 0)
+          {
+            fprintf(stderr,"%s\n",msg);
+            exit(1);
+          }
+
+        p += n_used;
+      }
+
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+    return(d.count());
+  }
+
+int main
+  (
+    int argc,
+    const char **argv
+  )
+  {
+    size_t size = 256, span_len = 16*1024;
+    std::vector<char> text;
+    int impl,best;
+    double secs;
+    Mcr_context *ctx = mcr_new_context();
+
+
+    /* discard results */
+    (void) mcr_sink_func(ctx,(Mcr_sink_func) 0,(void *) 0);
+
+    if (argc > 1)
+      size = size_t(atol(argv[1]));
+    if (argc > 2)
+      span_len = size_t(atol(argv[2]));
+
+    make_input(text,size * 1024 * 1024);
+
+    best = scan_select(SCAN_AVX2);
+    for (impl = SCAN_SCALAR; impl <= best; impl++)
+      {
+        scan_select(impl);
+
+        /* warm up, then measure */
+        (void) run(ctx,text,span_len);
+        secs = run(ctx,text,span_len);
+
+        printf("%-8s %10.1f MB/s\n",impl_name[impl],
+               double(text.size()) / (1024.0 * 1024.0) / secs);
+      }
+
+    mcr_delete_context(ctx);
+
+    return(0);
+  }
@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2016 Walter William Karas
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+  benchmark for the cache of compiled forms of text scheduled by
+  built-in macros.  runs a loop whose clauses are the same text on
+  every iteration, then a loop which expands the same text with the
+  expand macro, and one which expands a text that is different on
+  every iteration, so it is never found in the cache.  prints the
+  number of texts scheduled, the percentage of them run from the
+  cache, and the time per iteration.
+
+  build with:
+
+    g++ -std=c++11 -O2 -o bench_text bench_text.cpp macro.cpp \
+      builtin.cpp calc.cpp scan.cpp crc.cpp
+
+  usage:
+
+    bench_text [number of iterations in thousands]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include "macro.h"
+
+/* in builtin.cpp */
+const char *def_builtins(Mcr_context *ctx);
+
+/* the definitions, name followed by body */
+static const char * const defs[] =
+  {
+    "b", "<b>$(1)</b>",
+    "td", "<td>$(1)</td>",
+    (const char *) 0
+  };
+
+/* the work done on each iteration, as a loop clause, and escaped to be
+   in an argument of expand */
+static const char clause[] =
+  "<tr>$(td (=alpha=))$(td (=$(b (=beta=))=))$(td (=gamma=))</tr>";
+static const char escaped[] =
+  "<tr>$$(td (=alpha=))$$(td (=$$(b (=beta=))=))$$(td (=gamma=))</tr>";
+
+/*
+  expand a loop of n iterations, with the given text as its middle
+  clause, and print the statistics for it
+*/
+static void run
+  (
+    const char *title,
+    Mcr_context *ctx,
+    long int n,
+    const std::string &middle
+  )
+  {
+    std::string text = "$(let !i! !0!)$(loop (=$(if !$(i) = " +
+                       std::to_string(n) + "! (=$(break)=))=) (=" + middle +
+                       "=) (=$(let !i! !$(i) + 1!)=))";
+    const char *p = text.data(), *end = p + text.size(), *msg;
+    unsigned long int n_sched, n_cached, n_sched0, n_cached0;
+    size_t n_used;
+
+
+    n_sched0 = mcr_n_scheduled(ctx,&n_cached0);
+
+    mcr_start_expand(ctx,0,(const char **) 0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (msg = (const char *) 0; (p != end) && (msg == (const char *) 0);
+         p += n_used)
+      msg = mcr_next_chars(ctx,p,size_t(end - p),&n_used);
+    if (msg == (const char *) 0)
+      msg = mcr_flush_sink(ctx);
+    if (msg != (const char *) 0)
+      {
+        fprintf(stderr,"%s\n",msg);
+        exit(1);
+      }
+
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+    n_sched = mcr_n_scheduled(ctx,&n_cached) - n_sched0;
+    n_cached -= n_cached0;
+
+    printf("%-9s %10lu texts %6.1f%% cached %8.1f ns/iteration\n",title,
+           n_sched,100.0 * double(n_cached) / double(n_sched),
+           1e9 * d.count() / double(n));
+  }
+
+int main
+  (
+    int argc,
+    const char **argv
+  )
+  {
+    long int n = 200;
+    Mcr_context *ctx = mcr_new_context();
+    const char *msg;
+    int i;
+
+
+    if (argc > 1)
+      n = atol(argv[1]);
+    n *= 1000;
+
+    msg = def_builtins(ctx);
+    for (i = 0; (msg == (const char *) 0) && (defs[i] != (const char *) 0);
+         i += 2)
+      msg = mcr_def(ctx,defs[i],(void *) defs[i + 1],1);
+    if (msg != (const char *) 0)
+      {
+        fprintf(stderr,"%s\n",msg);
+        exit(1);
+      }
+
+    /* the output is discarded */
+    (void) mcr_sink_func(ctx,(Mcr_sink_func) 0,(void *) 0);
+
+    run("loop",ctx,n,clause);
+    run("same",ctx,n,std::string("$(expand !") + escaped + " x!)");
+    run("distinct",ctx,n,std::string("$(expand !") + escaped + " $(i)!)");
+
+    mcr_delete_context(ctx);
+
+    return(0);
+  }
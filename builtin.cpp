@@ -24,9 +24,14 @@ SOFTWARE.
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <string>
+#include <vector>
 #include "macro.h"
 #include "calc.h"
 
+/* largest block of copies of its string the repeat macro makes */
+#define REPEAT_BLOCK 65536
+
 
 /*
   local function to copy long int as string into output without
@@ -34,23 +39,35 @@ SOFTWARE.
 */
 static const char *outnum
   (
+    Mcr_context *ctx,
     long int num
   )
   {
     /* buffer to contain numeric result in string form */
     char num_str[((sizeof(long int) * CHAR_BIT) / 3) + 5];
 
-    const char *p,*q;
+    int len;
 
 
-    (void) sprintf(num_str,"%ld",num);
-    q = num_str;
-    while (*q != (char) '\0')
-      {
-        p = mcr_noeval_char(*(q++));
-        if (p != (const char *) 0)
-          return(p);
-      }
+    len = sprintf(num_str,"%ld",num);
+
+    return(mcr_noeval_span(ctx,num_str,size_t(len)));
+  }
+
+
+/*
+  local function to get the value of a name in a numeric expression
+*/
+static const char *name_value
+  (
+    void *data,
+    const char *name,
+    size_t len,
+    long int *value
+  )
+  {
+    if (!mcr_name_value((Mcr_context *) data,name,len,value))
+      return("name in numeric expression is not defined as a number");
 
     return((const char *) 0);
   }
@@ -61,6 +78,7 @@ static const char *outnum
 */
 static const char *bi_set
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -75,10 +93,15 @@ static const char *bi_set
     /* make n_arg = index of last argument */
     n_arg--;
 
-    for (i = 1; i < n_arg; i++)
+    /* define the first macro */
+    p = mcr_def(ctx,arg[1],(void *) arg[n_arg],1);
+    if (p != (const char *) 0)
+      return(p);
+
+    /* the other macros share its body */
+    for (i = 2; i < n_arg; i++)
       {
-        /* define the macro */
-        p = mcr_def(arg[i],(void *) arg[n_arg],1);
+        p = mcr_copy_def(ctx,arg[i],arg[1]);
         if (p != (const char *) 0)
 	  return(p);
       }
@@ -93,6 +116,7 @@ static const char *bi_set
 */
 static const char *bi_let
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -100,8 +124,6 @@ static const char *bi_let
     const char *p;
     int i;
     long int value;
-    /* buffer to contain numeric result in string form */
-    char num_str[((sizeof(long int) * CHAR_BIT) / 3) + 5];
 
 
     if (n_arg < 3)
@@ -110,16 +132,14 @@ static const char *bi_let
     /* make n_arg = index of last argument */
     n_arg--;
 
-    p = calc(arg[n_arg],&value);
+    p = calc(arg[n_arg],&value,name_value,(void *) ctx);
     if (p != (const char *) 0)
       return(p);
 
-    (void) sprintf(num_str,"%ld",value);
-
     for (i = 1; i < n_arg; i++)
       {
-        /* define the macro */
-        p = mcr_def(arg[i],(void *) num_str,1);
+        /* define the macro, the value is kept as a number */
+        p = mcr_def_num(ctx,arg[i],value);
         if (p != (const char *) 0)
 	  return(p);
       }
@@ -133,6 +153,7 @@ static const char *bi_let
 */
 static const char *bi_calc
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -144,11 +165,11 @@ static const char *bi_calc
     if (n_arg != 2)
       return("calc macro requires exactly 1 argument");
 
-    p = calc(arg[1],&r);
+    p = calc(arg[1],&r,name_value,(void *) ctx);
     if (p != (const char *) 0)
       return(p);
 
-    return(outnum(r));
+    return(outnum(ctx,r));
   }
 
 
@@ -157,25 +178,15 @@ static const char *bi_calc
 */
 static const char *bi_expand
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
   {
-    const char *p,*q;
-
-
     if (n_arg != 2)
       return("expand macro requires exactly 1 argument");
 
-    p = arg[1];
-    while (*p != (char) '\0')
-      {
-        q = mcr_next_char(*(p++));
-        if (q != (const char *) 0)
-          return(q);
-      }
-
-    return((const char *) 0);
+    return(mcr_expand_text(ctx,arg[1],(Mcr_continuation) 0,0L));
   }
 
 
@@ -184,6 +195,7 @@ static const char *bi_expand
 */
 static const char *bi_if
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -195,7 +207,7 @@ static const char *bi_if
     if ((n_arg < 3) || (n_arg > 4))
       return("if macro requires 2 or 3 arguments");
 
-    p = calc(arg[1],&r);
+    p = calc(arg[1],&r,name_value,(void *) ctx);
     if (p != (const char *) 0)
       return(p);
 
@@ -203,47 +215,58 @@ static const char *bi_if
        second */
 
     if (r)
-      return(bi_expand(2,arg + 1));
+      return(bi_expand(ctx,2,arg + 1));
     else if (n_arg == 4)
-      return(bi_expand(2,arg + 2));
+      return(bi_expand(ctx,2,arg + 2));
 
     return((const char *) 0);
   }
 
 
 /*
-  repeat macro
+  repeat macro.  copies of the string are made by doubling a block of
+  them, up to REPEAT_BLOCK characters, which is then output as many
+  times as needed.
 */
 static const char *bi_repeat
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
   {
-    const char *p,*q;
-    long int r;
+    thread_local std::string block;
+    const char *p;
+    long int r,n;
+    size_t len;
 
 
     if (n_arg != 3)
       return("repeat macro requires exactly 2 arguments");
 
     /* get number of times to repeat */
-    p = calc(arg[2],&r);
+    p = calc(arg[2],&r,name_value,(void *) ctx);
     if (p != (const char *) 0)
       return(p);
 
-    while (r--)
+    len = strlen(arg[1]);
+    if ((r <= 0L) || (len == 0))
+      return((const char *) 0);
+
+    block.assign(arg[1],len);
+    for (n = 1L; ((2L * n) <= r) && ((2 * block.size()) <= REPEAT_BLOCK);
+         n *= 2L)
+      block += block;
+
+    for ( ; r >= n; r -= n)
       {
-	q = arg[1];
-	while (*q != (char) '\0')
-	  {
-	    p = mcr_noeval_char(*(q++));
-	    if (p != (const char *) 0)
-	      return(p);
-	  }
+        p = mcr_noeval_span(ctx,block.data(),block.size());
+        if (p != (const char *) 0)
+          return(p);
       }
 
-    return((const char *) 0);
+    /* the rest are at the start of the block */
+    return(mcr_noeval_span(ctx,block.data(),size_t(r) * len));
   }
 
 
@@ -252,6 +275,7 @@ static const char *bi_repeat
 */
 static const char *bi_null
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -260,9 +284,29 @@ static const char *bi_null
       return("null macro requires exactly 1 argument");
 
     if (arg[1][0] == (char) '\0')
-      return(mcr_noeval_char((char) '1'));
+      return(mcr_noeval_char(ctx,(char) '1'));
     else
-      return(mcr_noeval_char((char) '0'));
+      return(mcr_noeval_char(ctx,(char) '0'));
+  }
+
+
+/*
+  find the first occurrence of a string in a span of text, using the
+  library's memmem(), which takes linear time.  returns null if the
+  string does not occur, or is empty.
+*/
+static const char *find
+  (
+    const char *text,
+    size_t len,
+    const char *str,
+    size_t str_len
+  )
+  {
+    if (str_len == 0)
+      return((const char *) 0);
+
+    return(static_cast<const char *>(memmem(text,len,str,str_len)));
   }
 
 
@@ -272,37 +316,122 @@ static const char *bi_null
 */
 static const char *bi_index
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
   {
-    const char *start_match,*p,*q;
+    const char *p;
 
 
     if (n_arg != 3)
       return("index macro requires exactly 2 arguments");
 
-    start_match = arg[2];
-    q = arg[1];
-    while (*start_match != (char) '\0')
+    p = find(arg[2],strlen(arg[2]),arg[1],strlen(arg[1]));
+    if (p == (const char *) 0)
+      return(mcr_noeval_char(ctx,(char) '0'));
+
+    return(outnum(ctx,((long int) (p - arg[2])) + 1L));
+  }
+
+
+/*
+  like index, but finds the last occurrence of the first string in
+  the second.  the second string is searched in place, from its end,
+  for the first string read backwards, with the Knuth-Morris-Pratt
+  method, so the time is linear in the lengths of the strings.
+*/
+static const char *bi_rindex
+  (
+    Mcr_context *ctx,
+    int n_arg,
+    const char **arg
+  )
+  {
+    /* border[i] is the length of the longest proper border of the last
+       i + 1 characters of the first string */
+    thread_local std::vector<size_t> border;
+    const char *str,*p;
+    size_t str_len,len,i,k;
+
+
+    if (n_arg != 3)
+      return("rindex macro requires exactly 2 arguments");
+
+    str = arg[1];
+    str_len = strlen(str);
+    len = strlen(arg[2]);
+    if ((str_len == 0) || (str_len > len))
+      return(mcr_noeval_char(ctx,(char) '0'));
+
+    /* character i of the string read backwards is str[str_len - 1 - i] */
+    border.resize(str_len);
+    border[0] = 0;
+    for (i = 1, k = 0; i < str_len; i++)
       {
-        if (*start_match == *q)
+        while ((k > 0) && (str[str_len - 1 - i] != str[str_len - 1 - k]))
+          k = border[k - 1];
+        if (str[str_len - 1 - i] == str[str_len - 1 - k])
+          k++;
+        border[i] = k;
+      }
+
+    /* k is the number of characters matched, ending at the end.  when
+       none are, the library's memrchr() skips to the last character of
+       the string */
+    for (p = arg[2] + len, k = 0; p != arg[2]; )
+      {
+        if (k == 0)
           {
-            p = start_match;
-            do
-              {
-                if (*(++q) == (char) '\0')
-                  /* match has been found */
-                  return(outnum(
-                    ((long int) (start_match - arg[2])) + 1L));
-              }
-            while (*(++p) == *q);
-	    q = arg[1];
+            p = static_cast<const char *>(memrchr(arg[2],str[str_len - 1],
+                                                  size_t(p - arg[2])));
+            if (p == (const char *) 0)
+              break;
+            k = 1;
           }
-        start_match++;
+        else
+          {
+            p--;
+            while ((k > 0) && (*p != str[str_len - 1 - k]))
+              k = border[k - 1];
+            if (*p == str[str_len - 1 - k])
+              k++;
+          }
+        if (k == str_len)
+          return(outnum(ctx,((long int) (p - arg[2])) + 1L));
       }
 
-    return(mcr_noeval_char((char) '0'));
+    return(mcr_noeval_char(ctx,(char) '0'));
+  }
+
+
+/*
+  returns the number of occurrences of the first string in the second
+  which do not overlap, found from the start.
+*/
+static const char *bi_count
+  (
+    Mcr_context *ctx,
+    int n_arg,
+    const char **arg
+  )
+  {
+    const char *p,*end;
+    size_t str_len;
+    long int n = 0;
+
+
+    if (n_arg != 3)
+      return("count macro requires exactly 2 arguments");
+
+    str_len = strlen(arg[1]);
+    end = arg[2] + strlen(arg[2]);
+    for (p = arg[2];
+         (p = find(p,size_t(end - p),arg[1],str_len)) != (const char *) 0;
+         p += str_len)
+      n++;
+
+    return(outnum(ctx,n));
   }
 
 
@@ -311,6 +440,7 @@ static const char *bi_index
 */
 static const char *bi_length
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -318,7 +448,7 @@ static const char *bi_length
     if (n_arg != 2)
       return("length macro requires exactly 1 argument");
 
-    return(outnum((long int) strlen(arg[1])));
+    return(outnum(ctx,(long int) strlen(arg[1])));
   }
 
 
@@ -329,6 +459,7 @@ static const char *bi_length
 */
 static const char *bi_substring
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -337,7 +468,7 @@ static const char *bi_substring
     long int len;
 
     long int start,count;
-    const char *p,*q;
+    const char *p;
 
 
     if (n_arg != 4)
@@ -345,12 +476,12 @@ static const char *bi_substring
       return("substring macro requires 2 or 3 arguments");
 
     len = (long int) strlen(arg[1]);
-    p = calc(arg[2],&start);
+    p = calc(arg[2],&start,name_value,(void *) ctx);
     if (p != (const char *) 0)
       return(p);
     if (n_arg == 4)
       {
-        p = calc(arg[3],&count);
+        p = calc(arg[3],&count,name_value,(void *) ctx);
         if (p != (const char *) 0)
           return(p);
       }
@@ -360,26 +491,16 @@ static const char *bi_substring
     if ((start < 1L) || (count < 1L) || ((start - 1L + count) > len))
       return("illegal substring");
 
-    q = arg[1] + start - 1L;
-    while (count--)
-      {
-        p = mcr_noeval_char(*(q++));
-        if (p != (const char *) 0)
-          return(p);
-      }
-
-    return((const char *) 0);
+    return(mcr_noeval_span(ctx,arg[1] + start - 1L,size_t(count)));
   }
 
 
-/* flag which indicates break macro invoked within loop macro */
-static int break_flag;
-
 /*
   break macro
 */
 static const char *bi_break
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **
   )
@@ -387,42 +508,56 @@ static const char *bi_break
     if (n_arg != 1)
       return("break macro should have no arguments");
 
-    break_flag = 1;
+    /* flag that break macro invoked within loop macro */
+    mcr_set_break(ctx,1);
     return((const char *) 0);
   }
 
 
+/*
+  called when a loop macro argument has been expanded.  count is
+  the index of the argument.  schedules the expansion of the next
+  argument, unless break was invoked.
+*/
+static const char *loop_next
+  (
+    Mcr_context *ctx,
+    int n_arg,
+    const char **arg,
+    long int count
+  )
+  {
+    if (mcr_get_break(ctx))
+      {
+        /* reset so we don't pop out of outer loops */
+        mcr_set_break(ctx,0);
+        return((const char *) 0);
+      }
+
+    count++;
+    if (count == n_arg)
+      count = 1;
+
+    return(mcr_expand_text(ctx,arg[count],loop_next,count));
+  }
+
+
 /*
   loop
 */
 static const char *bi_loop
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
   {
-    int i;
-    const char *p;
-
-
     if (n_arg < 2)
       return("loop macro must have at least one argument");
 
-    break_flag = 0;
-    for ( ; ; )
-      for (i = 1; i < n_arg; i++)
-        {
-          /* bi_expand() requires 2 args but ignores first one */
-          p = bi_expand(2,arg - 1 + i);
-          if (p != (const char *) 0)
-            return(p);
-          if (break_flag)
-	    {
-              /* reset so we don't pop out of outer loops */
-	      break_flag = 0;
-              return((const char *) 0);
-            }
-        }
+    mcr_set_break(ctx,0);
+
+    return(mcr_expand_text(ctx,arg[1],loop_next,1L));
   }
 
 
@@ -432,6 +567,7 @@ static const char *bi_loop
 */
 static const char *bi_numeric
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -439,7 +575,7 @@ static const char *bi_numeric
     if (n_arg != 2)
       return("numeric macro requires exactly 1 argument");
 
-    return(outnum((long int) ((unsigned long int) arg[1][0])));
+    return(outnum(ctx,(long int) ((unsigned long int) arg[1][0])));
   }
 
 
@@ -448,6 +584,7 @@ static const char *bi_numeric
 */
 static const char *bi_byte
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -459,11 +596,11 @@ static const char *bi_byte
     if (n_arg != 2)
       return("byte macro requires exactly 1 argument");
 
-    p = calc(arg[1],&r);
+    p = calc(arg[1],&r,name_value,(void *) ctx);
     if (p != (const char *) 0)
       return(p);
 
-    return(mcr_noeval_char((char) r));
+    return(mcr_noeval_char(ctx,(char) r));
   }
 
 
@@ -476,6 +613,7 @@ const char *bad_2nd_arg = "2nd argument is not =, >, <, <>, <= or >=";
 */
 static const char *bi_string_compare
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -526,9 +664,9 @@ static const char *bi_string_compare
       }
 
     if (bool_result)
-      return(mcr_noeval_char((char) '1'));
+      return(mcr_noeval_char(ctx,(char) '1'));
     else
-      return(mcr_noeval_char((char) '0'));
+      return(mcr_noeval_char(ctx,(char) '0'));
   }
     
 
@@ -537,6 +675,7 @@ static const char *bi_string_compare
 */
 static const char *bi_error
   (
+    Mcr_context *,
     int n_arg,
     const char **arg
   )
@@ -549,74 +688,122 @@ static const char *bi_error
 
 
 /*
-  define the builtins in this file
+  mark macros as constant, so invocations of them in bodies defined
+  later can be replaced by their results
 */
-const char *def_builtins(void)
+static const char *bi_constant
+  (
+    Mcr_context *ctx,
+    int n_arg,
+    const char **arg
+  )
+  {
+    const char *p;
+    int i;
+
+
+    if (n_arg < 2)
+      return("constant macro requires at least 1 argument");
+
+    for (i = 1; i < n_arg; i++)
+      {
+        p = mcr_set_constant(ctx,arg[i]);
+        if (p != (const char *) 0)
+          return(p);
+      }
+
+    return((const char *) 0);
+  }
+
+
+/*
+  define the builtins in this file.  those whose results only depend on
+  their arguments are pure.  calc, repeat, substring and byte also use
+  the values of macros named in numeric expressions, but
+  mcr_name_value() refuses every name when an invocation is folded, so
+  those invocations are not
+*/
+const char *def_builtins
+  (
+    Mcr_context *ctx
+  )
   {
     const char *p;
 
 
-    p = mcr_def("set",(void *) bi_set,0);
+    p = mcr_def(ctx,"set",(void *) bi_set,0);
+    if (p != (const char *) 0)
+      return(p); 
+
+    p = mcr_def(ctx,"let",(void *) bi_let,0);
+    if (p != (const char *) 0)
+      return(p); 
+
+    p = mcr_def_pure(ctx,"calc",(void *) bi_calc);
+    if (p != (const char *) 0)
+      return(p); 
+
+    p = mcr_def(ctx,"if",(void *) bi_if,0);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("let",(void *) bi_let,0);
+    p = mcr_def_pure(ctx,"repeat",(void *) bi_repeat);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("calc",(void *) bi_calc,0);
+    p = mcr_def_pure(ctx,"null",(void *) bi_null);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("if",(void *) bi_if,0);
+    p = mcr_def_pure(ctx,"index",(void *) bi_index);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("repeat",(void *) bi_repeat,0);
+    p = mcr_def_pure(ctx,"rindex",(void *) bi_rindex);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("null",(void *) bi_null,0);
+    p = mcr_def_pure(ctx,"count",(void *) bi_count);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("index",(void *) bi_index,0);
+    p = mcr_def_pure(ctx,"length",(void *) bi_length);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("length",(void *) bi_length,0);
+    p = mcr_def(ctx,"break",(void *) bi_break,0);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("break",(void *) bi_break,0);
+    p = mcr_def(ctx,"loop",(void *) bi_loop,0);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("loop",(void *) bi_loop,0);
+    p = mcr_def_pure(ctx,"substring",(void *) bi_substring);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("substring",(void *) bi_substring,0);
+    p = mcr_def(ctx,"expand",(void *) bi_expand,0);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("expand",(void *) bi_expand,0);
+    p = mcr_def(ctx,"error",(void *) bi_error,0);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("error",(void *) bi_error,0);
+    p = mcr_def_pure(ctx,"byte",(void *) bi_byte);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("byte",(void *) bi_byte,0);
+    p = mcr_def_pure(ctx,"numeric",(void *) bi_numeric);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("numeric",(void *) bi_numeric,0);
+    p = mcr_def_pure(ctx,"string_compare",(void *) bi_string_compare);
     if (p != (const char *) 0)
       return(p); 
 
-    p = mcr_def("string_compare",(void *) bi_string_compare,0);
+    p = mcr_def(ctx,"constant",(void *) bi_constant,0);
     if (p != (const char *) 0)
       return(p); 
 
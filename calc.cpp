@@ -18,7 +18,11 @@ SOFTWARE.
 */
 
 /*
-  function for evaluating numeric expression in string form
+  function for evaluating numeric expression in string form.
+  expressions evaluated repeatedly are compiled into postfix code,
+  which is kept in a cache so they are not parsed again.  names in
+  an expression are compiled as such, their values are gotten each
+  time it is run.
 */
 
 #undef DEBUG
@@ -27,6 +31,12 @@ SOFTWARE.
 #include "stdio.h"
 #endif
 
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "symtab.h"
+#include "calc.h"
+
 
 /*
   function checks if first string is prefix of second string.
@@ -91,9 +101,84 @@ int is_match
 #define T_TIMES 16
 #define T_DIV 17
 #define T_MOD 18
+/* name whose value is a number.  not an operator */
+#define T_NAME 19
+
+
+
+/* operation of compiled expression */
+struct calc_op
+  {
+    /* T_NUMBER to push a number, T_NAME to push the value of a name,
+       a binary operator token code, or OP_UNARY plus the code of a
+       unary operation */
+    int code;
+    /* length of name */
+    int len;
+    /* number to push, or offset of name in the expression */
+    long int num;
+  };
+
+/* code for unary operations in compiled expression */
+#define OP_UNARY 32
+
+/* operand and following operator, or following right parenthesis */
+struct calc_pair
+  {
+    /* operand */
+    long int number;
+    /* token code for operator/paren. */
+    int op_code;
+  };
 
-/* variable where value of numeric token is put */
-static long int num_val;
+/* parenthesized expression being evaluated */
+struct calc_level
+  {
+    /* number of active number/op pairs in the enclosing expression */
+    int n_local_pairs;
+    /* code for unary operator to apply to the value of the expression */
+    int un_code;
+  };
+
+/* stacks for evaluation.  they grow as needed, so there is no limit on
+   the length of an expression or the depth of parentheses in it */
+struct calc_stacks
+  {
+    /* pairs of the expressions being evaluated */
+    std::vector<calc_pair> pair;
+    /* parenthesized expressions being evaluated */
+    std::vector<calc_level> level;
+    /* numbers, for running compiled expressions */
+    std::vector<long int> num;
+  };
+
+/* state of an evaluation.  it is local to calc(), so evaluations can
+   be done concurrently */
+struct calc_state
+  {
+    /* stacks, provided by the caller so they can be reused */
+    calc_stacks *stk;
+    /* largest number of pairs on the stack at once */
+    size_t max_pairs;
+
+    /* variable where value of numeric token is put */
+    long int num_val;
+
+    /* start of expression */
+    const char *expr;
+    /* function to get values of names, and data to pass it */
+    Calc_name_func name_func;
+    void *data;
+    /* offset in the expression and length of name token */
+    size_t name_off,name_len;
+    /* error getting the value of a name, null if none */
+    const char *err;
+
+    /* if not null, code for the expression is generated into this, as
+       it is evaluated.  the code does the operations in the same order
+       as the evaluation */
+    std::vector<calc_op> *code;
+  };
 
 
 /*
@@ -101,6 +186,7 @@ static long int num_val;
 */
 int get_token
   (
+    calc_state *cs,
     /* pointer to pointer to the string to extract the 
        next token from.  pointer to string is updated to
        next character after token */
@@ -108,6 +194,15 @@ int get_token
   )
   {
     int c;
+    const char *w,*k,*d;
+    size_t n;
+    static const struct { const char *word; int tok; } keyword[] =
+      {
+        { "or", T_OR },
+        { "and", T_AND },
+        { "not", T_NOT },
+        { "mod", T_MOD }
+      };
 
 
     /* skip over white space */
@@ -116,15 +211,58 @@ int get_token
            || (c == '\n'))
       c = (int) *((*str)++);
 
+    if ((('a' <= c) && (c <= 'z')) || (('A' <= c) && (c <= 'Z'))
+        || (c == '_'))
+      /* token is a word, which is a keyword operator or a name */
+      {
+        w = --(*str);
+        for (n = 1; ; n++)
+          {
+            c = (int) w[n];
+            if (!((('a' <= c) && (c <= 'z')) || (('A' <= c) && (c <= 'Z'))
+                  || (('0' <= c) && (c <= '9')) || (c == '_')))
+              break;
+          }
+
+        /* a keyword is an operator, also when followed directly by a
+           number (as in 7mod3, formed by substituting values) */
+        for (const auto &kw : keyword)
+          {
+            k = w;
+            if (is_match(kw.word,&k))
+              {
+                for (d = k; ('0' <= *d) && (*d <= '9'); d++)
+                  ;
+                if (d == w + n)
+                  {
+                    *str = k;
+                    return(kw.tok);
+                  }
+              }
+          }
+
+        *str += n;
+        if (cs->name_func == (Calc_name_func) 0)
+          return(T_ERROR);
+
+        cs->name_off = size_t(w - cs->expr);
+        cs->name_len = n;
+        cs->err = cs->name_func(cs->data,w,n,&(cs->num_val));
+        if (cs->err != (const char *) 0)
+          return(T_ERROR);
+
+        return(T_NAME);
+      }
+
     if (('0' <= c) && (c <= '9'))
       /* token is a number */
       {
-        num_val = (long int) (c - '0');
+        cs->num_val = (long int) (c - '0');
         c = (int) **str;
         while (('0' <= c) && (c <= '9'))
           {
-            num_val *= 10L;
-            num_val += (long int) (c - '0');
+            cs->num_val *= 10L;
+            cs->num_val += (long int) (c - '0');
             c = (int) *(++(*str));
           }
         return(T_NUMBER);
@@ -132,10 +270,6 @@ int get_token
 
     /* token is parethesis or operator */
 
-    /* convert to lower case if necessary */
-    if (('A' <= c) && (c <= 'Z'))
-      c +=  'a' - 'A';
-
     switch (c)
       {
         case '\0':
@@ -149,24 +283,6 @@ int get_token
         case ')':
           return(T_RIGHT_PAREN);
 
-        case 'o':
-          if (is_match("r",str))
-            return(T_OR);
-          else
-            return(T_ERROR);
-
-        case 'a':
-          if (is_match("nd",str))
-            return(T_AND);
-          else
-            return(T_ERROR);
-
-        case 'n':
-          if (is_match("ot",str))
-            return(T_NOT);
-          else
-            return(T_ERROR);
-
         case '>':
           c = (int) **str;
           if (c == '=')
@@ -207,12 +323,6 @@ int get_token
         case '/':
           return(T_DIV);
 
-        case 'm':
-          if (is_match("od",str))
-            return(T_MOD);
-          else
-            return(T_ERROR);
-
         default:
           return(T_ERROR);
       }
@@ -261,137 +371,143 @@ const int compose_minus[] =
     UN_MINUS_MAKE_BOOL
   };
 
-#define N_PAIRS 128
-/* operand and following operator, or following right parenthesis */
-static struct
+
+/*
+  function to generate code for an operation
+*/
+static void gen
+  (
+    calc_state *cs,
+    int code,
+    long int num
+  )
   {
-    /* operand */
-    long int number;
-    /* token code for operator/paren. */
-    int op_code;
+    calc_op o;
+
+
+    o.code = code;
+    o.len = 0;
+    o.num = num;
+    cs->code->push_back(o);
   }
-pair[N_PAIRS],*pair_p;
-/* index of next pair structure to fill */
-static int i_pair;
 
-/* depth of parenthesis nesting */
-static int paren_depth;
 
-    
 /*
-  function to get next number/op pair
+  function to apply unary operation
 */
-const char *get_num_and_op
+static inline long int apply_unary
   (
-    const char **str
+    int un_code,
+    long int n
   )
   {
-    /* a token code */
-    int tok;
-    /* code for unary operator to apply to number */
-    int un_code;
+    switch (un_code)
+      {
+        case UN_NOT:
+          return(!n);
 
-    const char *p;
+        case UN_MINUS:
+          return(-n);
+
+        case UN_MINUS_NOT:
+          return(n ? 0 : -1);
 
-    /* prototype */
-    const char *eval_expr(const char **,long int *);
+        case UN_MAKE_BOOL:
+          return(n ? 1 : 0);
 
+        case UN_MINUS_MAKE_BOOL:
+          return(n ? -1 : 0);
+      }
 
-    if (i_pair == N_PAIRS)
-      return("buffer overflow during numeric expression evaluation");
-    pair_p = pair + i_pair;
-    i_pair++;
+    return(n);
+  }
 
-    /* get number */
-    un_code = UN_NULL;
 
-    for  ( ; ; )
+/*
+  function to apply binary operator.  returns string describing
+  error, null if no error.
+*/
+static inline const char *apply_binary
+  (
+    int op_code,
+    /* first operand, replaced by result */
+    long int *a,
+    /* second operand */
+    long int b
+  )
+  {
+    switch (op_code)
       {
-        tok = get_token(str);
-#if defined(DEBUG)
-        printf("string left after get_token: |%s|\n",*str);
-#endif
-        if ((tok == T_LEFT_PAREN) || (tok == T_NUMBER))
+        case T_OR:
+          *a = *a || b;
           break;
-        else if (tok == T_NOT)
-          un_code = compose_not[un_code];
-        else if (tok == T_MINUS)
-          un_code = compose_minus[un_code];
-        /* ignore unary + */
-        else if (tok != T_PLUS)
-          return("bad syntax in numeric expression");
-      }
 
-    if (tok == T_LEFT_PAREN)
-      {
-        paren_depth++;
-        /* recursively call evaluation function */
-        p = eval_expr(str,&(pair_p->number));
-        if (p != (char *) 0)
-          return(p);
-      }
-    else
-      /* number token */
-      pair_p->number = num_val;
+        case T_AND:
+          *a = *a && b;
+          break;
 
-    /* apply unary operator */
-    switch (un_code)
-      {
-        case UN_NULL:
+        case T_GT:
+          *a = *a > b;
           break;
 
-        case UN_NOT:
-          pair_p->number = !(pair_p->number);
+        case T_LT:
+          *a = *a < b;
           break;
 
-        case UN_MINUS:
-          pair_p->number = -(pair_p->number);
+        case T_GE:
+          *a = *a >= b;
           break;
 
-        case UN_MINUS_NOT:
-          if (pair_p->number)
-            pair_p->number = 0;
-          else
-            pair_p->number = -1;
+        case T_LE:
+          *a = *a <= b;
           break;
 
-        case UN_MAKE_BOOL:
-          if (pair_p->number)
-            pair_p->number = 1;
+        case T_EQ:
+          *a = *a == b;
           break;
 
-        case UN_MINUS_MAKE_BOOL:
-          if (pair_p->number)
-            pair_p->number = -1;
-      }
+        case T_NE:
+          *a = *a != b;
+          break;
 
-    /* get operator */
-    tok = get_token(str);
-#if defined(DEBUG)
-    printf("string left after get_token: |%s|\n",*str);
-#endif
-    if ((tok == T_LEFT_PAREN) || (tok == T_NUMBER) 
-        || (tok == T_ERROR) || (tok == T_NOT))
-      return("bad syntax in numeric expression");
+        case T_PLUS:
+          *a = *a + b;
+          break;
+
+        case T_MINUS:
+          *a = *a - b;
+          break;
 
-    pair_p->op_code = tok;
+        case T_TIMES:
+          *a = *a * b;
+          break;
 
-#if defined(DEBUG)
-    printf("pair %d: op=%d  num=%ld\n",
-           i_pair,pair_p->op_code,pair_p->number);
-#endif
+        case T_DIV:
+          if (b == 0)
+            return("division by zero in numeric expression");
+          *a = *a / b;
+          break;
+
+        case T_MOD:
+          if (b == 0)
+            return("division by zero in numeric expression");
+          *a = *a % b;
+      }
 
     return((const char *) 0);
   }
 
 
+
 /*
-  function to do evaluation up to closing parenthesis
-  or end of string.  returns string describing error,
-  null if no error.
+  function to do evaluation up to end of string.  parenthesized
+  expressions are evaluated with the same loop, using a stack of them,
+  rather than by recursion.  returns string describing error, null if
+  no error.
 */
 const char *eval_expr
   (
+    calc_state *cs,
     /* pointer to pointer to string to evaluate.  pointer
        to string updated to character after evaluated portion. */
     const char **str,
@@ -399,8 +515,16 @@ const char *eval_expr
     long int *e_res
   )
   {
-    /* number of active number/op pairs in current evaluation */
+    calc_stacks *stk = cs->stk;
+    /* number of active number/op pairs in innermost expression */
     int n_local_pairs;
+    /* a token code */
+    int tok;
+    /* code for unary operator to apply to number */
+    int un_code;
+    /* last pair */
+    calc_pair *pr;
+    calc_level lv;
 
     const char *p;
 
@@ -408,122 +532,350 @@ const char *eval_expr
     n_local_pairs = 0;
     for ( ; ; )
       {
-        /* get a number/op pair */
-        p = get_num_and_op(str);
-        if (p != (const char *) 0)
-          return(p);
-        n_local_pairs++;
+        /* get number */
+        un_code = UN_NULL;
 
-        while (n_local_pairs >= 2)
+        for  ( ; ; )
           {
-            if (pair_p->op_code > (pair_p - 1)->op_code)
-              /* second operator of greater precedence */
+            tok = get_token(cs,str);
+#if defined(DEBUG)
+            printf("string left after get_token: |%s|\n",*str);
+#endif
+            if ((tok == T_LEFT_PAREN) || (tok == T_NUMBER) || (tok == T_NAME))
               break;
+            else if (tok == T_NOT)
+              un_code = compose_not[un_code];
+            else if (tok == T_MINUS)
+              un_code = compose_minus[un_code];
+            /* ignore unary + */
+            else if (tok != T_PLUS)
+              return((cs->err != (const char *) 0) ? cs->err :
+                     "bad syntax in numeric expression");
+          }
 
-            /* the op in the current pair is of lower precedence
-               than the op in the previous pair, so simplify by
-               performing the op in the previous pair */
-            switch((pair_p - 1)->op_code)
+        if (tok == T_LEFT_PAREN)
+          {
+            /* begin evaluation of parenthesized expression.  its
+               value becomes the number of the enclosing expression */
+            lv.n_local_pairs = n_local_pairs;
+            lv.un_code = un_code;
+            stk->level.push_back(lv);
+            n_local_pairs = 0;
+
+            continue;
+          }
+
+        /* number or name token */
+        stk->pair.push_back(calc_pair());
+        if (stk->pair.size() > cs->max_pairs)
+          cs->max_pairs = stk->pair.size();
+        pr = &stk->pair.back();
+        pr->number = cs->num_val;
+        if (cs->code != (std::vector<calc_op> *) 0)
+          {
+            if (tok == T_NAME)
               {
-                case T_OR:
-                  (pair_p - 1)->number = (pair_p - 1)->number ||
-                                         pair_p->number;
-                  break;
+                /* the value is gotten each time the code is run */
+                gen(cs,T_NAME,(long int) cs->name_off);
+                cs->code->back().len = (int) cs->name_len;
+              }
+            else
+              gen(cs,T_NUMBER,cs->num_val);
+          }
 
-                case T_AND:
-                  (pair_p - 1)->number = (pair_p - 1)->number &&
-                                         pair_p->number;
-                  break;
+        /* apply unary operator */
+        if (un_code != UN_NULL)
+          {
+            pr->number = apply_unary(un_code,pr->number);
+            if (cs->code != (std::vector<calc_op> *) 0)
+              gen(cs,OP_UNARY + un_code,0L);
+          }
 
-                case T_GT:
-                  (pair_p - 1)->number = (pair_p - 1)->number >
-                                         pair_p->number;
-                  break;
+        /* get operators following the number, and the right
+           parentheses of expressions it ends */
+        for ( ; ; )
+          {
+            tok = get_token(cs,str);
+#if defined(DEBUG)
+            printf("string left after get_token: |%s|\n",*str);
+#endif
+            if ((tok == T_LEFT_PAREN) || (tok == T_NUMBER) || (tok == T_NAME)
+                || (tok == T_ERROR) || (tok == T_NOT))
+              return("bad syntax in numeric expression");
 
-                case T_LT:
-                  (pair_p - 1)->number = (pair_p - 1)->number <
-                                         pair_p->number;
-                  break;
+            stk->pair.back().op_code = tok;
+            n_local_pairs++;
 
-                case T_GE:
-                  (pair_p - 1)->number = (pair_p - 1)->number >=
-                                         pair_p->number;
-                  break;
+#if defined(DEBUG)
+            printf("pair %d: op=%d  num=%ld\n",int(stk->pair.size()),
+                   tok,stk->pair.back().number);
+#endif
 
-                case T_LE:
-                  (pair_p - 1)->number = (pair_p - 1)->number <=
-                                         pair_p->number;
+            while (n_local_pairs >= 2)
+              {
+                pr = &stk->pair.back();
+                if (pr->op_code > (pr - 1)->op_code)
+                  /* second operator of greater precedence */
                   break;
 
-                case T_EQ:
-                  (pair_p - 1)->number = (pair_p - 1)->number ==
-                                         pair_p->number;
-                  break;
+                /* the op in the current pair is of lower precedence
+                   than the op in the previous pair, so simplify by
+                   performing the op in the previous pair */
+                p = apply_binary((pr - 1)->op_code,&((pr - 1)->number),
+                                 pr->number);
+                if (p != (const char *) 0)
+                  return(p);
+                if (cs->code != (std::vector<calc_op> *) 0)
+                  gen(cs,(pr - 1)->op_code,0L);
+
+                (pr - 1)->op_code = pr->op_code;
+                stk->pair.pop_back();
+                n_local_pairs--;
+              }
 
-                case T_NE:
-                  (pair_p - 1)->number = (pair_p - 1)->number !=
-                                         pair_p->number;
-                  break;
+            pr = &stk->pair.back();
+            if ((n_local_pairs != 1) ||
+                ((pr->op_code != T_RIGHT_PAREN) &&
+                 (pr->op_code != T_END_STRING)))
+              /* a number follows */
+              break;
 
-                case T_PLUS:
-                  (pair_p - 1)->number = (pair_p - 1)->number +
-                                         pair_p->number;
-                  break;
+            if (pr->op_code == T_END_STRING)
+              {
+                /* make sure not inside parentheses */ 
+                if (!stk->level.empty())
+                  return("missing right parenthesis in numeric expression");
 
-                case T_MINUS:
-                  (pair_p - 1)->number = (pair_p - 1)->number -
-                                         pair_p->number;
-                  break;
+                *e_res = pr->number;
+                stk->pair.pop_back();
+                return((const char *) 0);
+              }
 
-                case T_TIMES:
-                  (pair_p - 1)->number = (pair_p - 1)->number *
-                                         pair_p->number;
-                  break;
+            /* make sure in parentheses */
+            if (stk->level.empty())
+              return("extra right parenthesis in numeric expression");
+
+            /* the pair left has the value of the parenthesized
+               expression.  it becomes a pair of the enclosing one,
+               and the operator following it is gotten */
+            lv = stk->level.back();
+            stk->level.pop_back();
+            n_local_pairs = lv.n_local_pairs;
+            if (lv.un_code != UN_NULL)
+              {
+                pr->number = apply_unary(lv.un_code,pr->number);
+                if (cs->code != (std::vector<calc_op> *) 0)
+                  gen(cs,OP_UNARY + lv.un_code,0L);
+              }
+          }
+      }
+  }
 
-                case T_DIV:
-                  (pair_p - 1)->number = (pair_p - 1)->number /
-                                         pair_p->number;
-                  break;
 
-                case T_MOD:
-                  (pair_p - 1)->number = (pair_p - 1)->number %
-                                         pair_p->number;
+/*
+  evaluate expression, generating code for it if code is not null.
+  returns pointer to message for error, null otherwise.
+*/
+static const char *eval
+  (
+    const char *expr,
+    long int *result,
+    Calc_name_func name_func,
+    void *data,
+    std::vector<calc_op> *code,
+    /* stacks for evaluation */
+    calc_stacks *stk,
+    /* set to largest number of pairs on the stack at once */
+    size_t *max_pairs
+  )
+  {
+    const char *p,*q;
+    calc_state cs;
 
-              }
-            (pair_p - 1)->op_code = pair_p->op_code;
-            pair_p--;
-            i_pair--;
-            n_local_pairs--;
-#if defined(DEBUG)
-            printf("pair %d: op=%d  num=%ld\n",
-                   i_pair,pair_p->op_code,pair_p->number);
-#endif
-          }
 
-        if (n_local_pairs == 1)
-          if ((pair_p->op_code == T_RIGHT_PAREN) ||
-              (pair_p->op_code == T_END_STRING))
-            {
-              /* if end of string, make sure not inside parentheses */ 
-              if ((pair_p->op_code == T_END_STRING) &&
-                  (paren_depth != 0))
-                return("missing right parenthesis in numeric expression");
-              /* if not end of string make sure in parentheses */
-              if (pair_p->op_code == T_RIGHT_PAREN)
-                {
-                  if (paren_depth == 0)
-                    return(
-                    "extra right parenthesis in numeric expression");
-                  paren_depth--;
-                }
-
-              *e_res = pair_p->number;
-              pair_p--;
-              i_pair--;
-              return((const char *) 0);
-            }
+    stk->pair.clear();
+    stk->level.clear();
+    cs.stk = stk;
+    cs.max_pairs = 0;
+    cs.code = code;
+    cs.expr = expr;
+    cs.name_func = name_func;
+    cs.data = data;
+    cs.err = (const char *) 0;
+
+    p = expr;
+    q = eval_expr(&cs,&p,result);
+    *max_pairs = cs.max_pairs;
+    if (q != (const char *) 0)
+      return(q);
+
+    if (get_token(&cs,&p) != T_END_STRING)
+      return("junk follows numeric expression");
+
+    return((const char *) 0);
+  }
+
+
+/*
+  run compiled expression.  the stack never holds more numbers than
+  there were pairs when the expression was compiled.  returns pointer
+  to message for error, null otherwise.
+*/
+static const char *run
+  (
+    const char *expr,
+    Calc_name_func name_func,
+    void *data,
+    const std::vector<calc_op> &code,
+    /* largest number of pairs */
+    size_t depth,
+    long int *result,
+    calc_stacks *stk
+  )
+  {
+    long int *t;
+    const char *p;
+
+
+    if (stk->num.size() < depth)
+      stk->num.resize(depth);
+    /* top of stack */
+    t = stk->num.data() - 1;
+
+    for (const calc_op &o : code)
+      if (o.code == T_NUMBER)
+        *(++t) = o.num;
+      else if (o.code == T_NAME)
+        {
+          /* code with names is cached also when it was compiled for a
+             caller which allowed them */
+          if (name_func == (Calc_name_func) 0)
+            return("bad syntax in numeric expression");
+          p = name_func(data,expr + o.num,size_t(o.len),++t);
+          if (p != (const char *) 0)
+            return(p);
+        }
+      else if (o.code >= OP_UNARY)
+        *t = apply_unary(o.code - OP_UNARY,*t);
+      else
+        {
+          /* binary operator, the operands are the top two numbers */
+          t--;
+          p = apply_binary(o.code,t,t[1]);
+          if (p != (const char *) 0)
+            return(p);
+        }
+
+    *result = *t;
+
+    return((const char *) 0);
+  }
+
+
+/* maximum number of compiled expressions in the cache of a thread */
+#define CALC_CACHE_SIZE 1024
+/* number of hashes of expressions recently evaluated, which are not
+   in the cache, kept.  must be a power of 2 */
+#define CALC_SEEN_SIZE 4096
+
+/* compiled expression in the cache */
+struct calc_code
+  {
+    std::vector<calc_op> code;
+    /* largest number of pairs on the stack when it was compiled */
+    size_t depth;
+    /* neighbours in list of entries of the cache, from most to least
+       recently used */
+    Sym_tab<calc_code>::Entry *prev,*next;
+  };
 
+/* cache of compiled expressions, keyed by the text of the expression.
+   each thread has its own, so no locking is needed */
+struct calc_cache
+  {
+    Sym_tab<calc_code> tab;
+    /* most and least recently used entries */
+    Sym_tab<calc_code>::Entry *first,*last;
+    /* number of entries */
+    size_t n;
+    /* an expression is only put in the cache when it is evaluated a
+       second time, so ones evaluated only once, like those formed from
+       changing values of macros, are not compiled and do not displace
+       others.  this holds hashes of expressions evaluated, indexed by
+       their low bits */
+    unsigned int seen[CALC_SEEN_SIZE];
+    /* code of expression being compiled, reused */
+    std::vector<calc_op> scratch;
+    /* stacks for evaluation, reused */
+    calc_stacks stacks;
+
+    calc_cache()
+      : first((Sym_tab<calc_code>::Entry *) 0),
+        last((Sym_tab<calc_code>::Entry *) 0), n(0), seen() { }
+
+    void unlink(Sym_tab<calc_code>::Entry *e);
+    void push_front(Sym_tab<calc_code>::Entry *e);
+  };
+
+/*
+  hash of an expression for the cache.  it is done a word at a time,
+  which is faster than the hash of the symbol table for strings the
+  length of typical expressions
+*/
+static unsigned int calc_hash
+  (
+    const char *s,
+    size_t len
+  )
+  {
+    uint64_t h = uint64_t(len) * 0x9e3779b97f4a7c15u, w;
+
+
+    for ( ; len >= 8; s += 8, len -= 8)
+      {
+        memcpy(&w,s,8);
+        h = (h ^ w) * 0xff51afd7ed558ccdu;
+        h ^= h >> 32;
       }
+
+    w = 0;
+    memcpy(&w,s,len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53u;
+    h ^= h >> 29;
+
+    return((unsigned int) h);
+  }
+
+/* remove entry from list of the cache */
+void calc_cache::unlink
+  (
+    Sym_tab<calc_code>::Entry *e
+  )
+  {
+    if (e->value.prev != (Sym_tab<calc_code>::Entry *) 0)
+      e->value.prev->value.next = e->value.next;
+    else
+      first = e->value.next;
+
+    if (e->value.next != (Sym_tab<calc_code>::Entry *) 0)
+      e->value.next->value.prev = e->value.prev;
+    else
+      last = e->value.prev;
+  }
+
+/* put entry at the front of list of the cache, as most recently used */
+void calc_cache::push_front
+  (
+    Sym_tab<calc_code>::Entry *e
+  )
+  {
+    e->value.prev = (Sym_tab<calc_code>::Entry *) 0;
+    e->value.next = first;
+    if (first != (Sym_tab<calc_code>::Entry *) 0)
+      first->value.prev = e;
+    else
+      last = e;
+    first = e;
   }
 
 
@@ -535,22 +887,64 @@ const char *calc
     /* expresion to evaluate */
     const char *expr,
     /* result of evaluation if no error */
-    long int *result
+    long int *result,
+    /* function to get the values of names, null if not allowed */
+    Calc_name_func name_func,
+    /* data to pass to name_func */
+    void *data
   )
   {
-    const char *p,*q;
+    thread_local calc_cache cache;
+    size_t len = strlen(expr);
+    unsigned int h = calc_hash(expr,len);
+    Sym_tab<calc_code>::Entry *e = cache.tab.find(expr,len,h);
+    unsigned int *seen = cache.seen + (h & (CALC_SEEN_SIZE - 1));
+    size_t depth;
+    const char *p;
+
 
+    if (e != (Sym_tab<calc_code>::Entry *) 0)
+      {
+        if (e != cache.first)
+          {
+            cache.unlink(e);
+            cache.push_front(e);
+          }
 
-    i_pair = 0;
-    paren_depth = 0;
+        return(run(expr,name_func,data,e->value.code,e->value.depth,result,
+                   &cache.stacks));
+      }
 
-    p = expr;
-    q = eval_expr(&p,result);
-    if (q != (const char *) 0)
-      return(q);
+    if (*seen != h)
+      {
+        /* not evaluated recently, do not compile */
+        *seen = h;
+        return(eval(expr,result,name_func,data,(std::vector<calc_op> *) 0,
+                    &cache.stacks,&depth));
+      }
 
-    if (get_token(&p) != T_END_STRING)
-      return("junk follows numeric expression");
+    /* expressions with errors are not cached */
+    cache.scratch.clear();
+    p = eval(expr,result,name_func,data,&(cache.scratch),&cache.stacks,
+             &depth);
+    if (p != (const char *) 0)
+      return(p);
+
+    if (cache.n == CALC_CACHE_SIZE)
+      {
+        /* remove least recently used entry */
+        Sym_tab<calc_code>::Entry *old = cache.last;
+
+        cache.unlink(old);
+        cache.tab.erase(old);
+        cache.n--;
+      }
+
+    e = cache.tab.insert(expr,len,h);
+    e->value.code = cache.scratch;
+    e->value.depth = depth;
+    cache.push_front(e);
+    cache.n++;
 
     return((const char *) 0);
   }
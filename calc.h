@@ -24,6 +24,14 @@ SOFTWARE.
 #if (!defined(H_CALC))
 #define H_CALC
 
+#include <stddef.h>
+
+/* function called to get the value of a name in an expression.  the
+   name is not null terminated.  it must return null for success, an
+   error message string for failure. */
+using Calc_name_func =
+  const char *(*)(void *data,const char *name,size_t len,long int *value);
+
 /*
   returns pointer to message for error, null otherwise
 */
@@ -32,7 +40,13 @@ const char *calc
     /* expresion to evaluate */
     const char *expr,
     /* result of evaluation if no error */
-    long int *result
+    long int *result,
+    /* function to get the values of names, null if names are not
+       allowed.  it is called each time the expression is evaluated,
+       so compiled expressions do not depend on the values */
+    Calc_name_func name_func,
+    /* data to pass to name_func */
+    void *data
   );
 
 #endif
@@ -28,108 +28,441 @@ SOFTWARE.
 #include <stdio.h>
 #endif
 
+#include <errno.h>
 #include <string.h>
 #include <limits.h> // defined INT_MAX
-#include <unordered_map>
+#include <unistd.h>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "stralloc.h"
+#include "scan.h"
+#include "symtab.h"
+#include "crc.h"
 
-#define MCR_FILE
 #include "macro.h"
 
+/* operation in a compiled macro body */
+struct Mcr_op
+  {
+    /* operation code, one of the OP_xxx values */
+    int code;
+    /* argument number for OP_ARG, hash of name for OP_NAME.  for
+       OP_INVOKE in a folded body, index of the operation in the
+       original body */
+    unsigned int n;
+    /* offset of text for operation in text of program */
+    unsigned int offset;
+    /* length of text for operation */
+    unsigned int len;
+  };
+
+/* a macro body compiled into a sequence of operations.  executing them
+   has the same effect as evaluating the characters of the body one at
+   a time, without the cost of analyzing the syntax again.  this is
+   where the compiler puts the program, it is copied into the body */
+struct Mcr_program
+  {
+    std::vector<Mcr_op> op;
+    /* text referred to by the operations */
+    std::string text;
+  };
+
+static bool compile(const char *body, Mcr_program *prog);
+
+/* body of a string macro which is too long to store in its Macro_value,
+   or which contains the lead character.  it is never changed once
+   created, and is shared by macros with the same definition, and by
+   evaluations of it in progress.  the text and the compiled form of
+   it follow the structure in the same allocation */
+struct Mcr_body
+  {
+    /* number of references */
+    unsigned int n_ref;
+    /* number of operations in compiled form of text, 0 if the text was
+       not compiled.  the operations follow the text, and the text they
+       refer to follows them */
+    unsigned int n_op;
+    /* length of text */
+    size_t len;
+    /* true if text contains the lead character.  false for a folded
+       body whose text is simply copied */
+    bool has_lead;
+    /* true if the body belongs to a frozen context, so may be in use by
+       other threads.  references to it are then not counted */
+    bool shared;
+    /* the body with invocations of constant macros replaced by their
+       results, null if there were none to replace.  it has one
+       reference from this body */
+    Mcr_body *fold;
+    /* value of the constant epoch of the context when it was folded.
+       the folded body is only used while the epoch is the same */
+    unsigned long int fold_epoch;
+    /* null terminated text */
+    char text[1];
+  };
+
+/* offset of compiled operations from start of body with text of length
+   len */
+static inline size_t body_op_offset(size_t len)
+  {
+    return((sizeof(Mcr_body) + len + (alignof(Mcr_op) - 1))
+           & ~(alignof(Mcr_op) - 1));
+  }
+
+/* first operation of compiled body */
+static inline const Mcr_op *body_op(const Mcr_body *b)
+  {
+    return(reinterpret_cast<const Mcr_op *>(
+             reinterpret_cast<const char *>(b) + body_op_offset(b->len)));
+  }
+
+/* create a body with a reference count of 1, from its text and its
+   compiled form (null if not compiled) */
+static Mcr_body *make_body
+  (
+    const char *text,
+    size_t len,
+    bool has_lead,
+    const Mcr_program *prog
+  )
+  {
+    size_t size = sizeof(Mcr_body) + len;
+
+    if (prog != (const Mcr_program *) 0)
+      size = body_op_offset(len) + (prog->op.size() * sizeof(Mcr_op))
+             + prog->text.size();
+
+    char *mem = static_cast<char *>(::operator new(size));
+    Mcr_body *b = reinterpret_cast<Mcr_body *>(mem);
+
+    b->n_ref = 1;
+    b->len = len;
+    memcpy(b->text, text, len);
+    b->text[len] = '\0';
+    b->has_lead = has_lead;
+    b->shared = false;
+    b->fold = (Mcr_body *) 0;
+    b->fold_epoch = 0;
+
+    if (prog != (const Mcr_program *) 0)
+      {
+        Mcr_op *op = reinterpret_cast<Mcr_op *>(mem + body_op_offset(len));
+
+        memcpy(op, prog->op.data(), prog->op.size() * sizeof(Mcr_op));
+        memcpy(op + prog->op.size(), prog->text.data(), prog->text.size());
+        b->n_op = (unsigned int) prog->op.size();
+      }
+    else
+      b->n_op = 0;
+
+    return(b);
+  }
+
+/* create a body with a reference count of 1 */
+static Mcr_body *new_body
+  (
+    const char *text,
+    size_t len
+  )
+  {
+    thread_local Mcr_program prog;
+    bool has_lead = memchr(text, '$', len) != (const void *) 0;
+    /* a body with no macro invocations or argument references is
+       copied just as fast without compiling it */
+    bool compiled = has_lead && compile(text, &prog);
+
+    return(make_body(text, len, has_lead,
+                     compiled ? &prog : (const Mcr_program *) 0));
+  }
+
+/* add a reference to a body */
+static inline void ref_body
+  (
+    Mcr_body *b
+  )
+  {
+    if (!b->shared)
+      b->n_ref++;
+  }
+
+/* drop a reference to a body, freeing it if it was the last one */
+static void release_body
+  (
+    Mcr_body *b
+  )
+  {
+    if (!b->shared && (--(b->n_ref) == 0))
+      {
+        if (b->fold != (Mcr_body *) 0)
+          release_body(b->fold);
+        ::operator delete(b);
+      }
+  }
+
 /* records defining macro type and body */
 class Macro_value
   {
   private:
 
-    bool has_string_;
+    /* kinds of value */
+    enum { NONE, INLINE, BODY, BUILT_IN, NUMBER };
+
+    /* flag in the kind, set for a macro marked constant.  changing the
+       definition clears it */
+    static const unsigned char CONSTANT = 0x80;
+
+    /* flag in the kind of a built-in macro defined by mcr_def_pure().
+       copies keep it */
+    static const unsigned char PURE = 0x40;
+
+    /* maximum length of a string body stored in the Macro_value itself,
+       without a separate allocation.  such bodies do not contain the
+       lead character */
+    static const size_t max_inline = 13;
 
+    /* the kind is the first byte of either member */
     union
       {
-        const char *c_string_;
-        Mcr_built_in_func bi_func_ptr_;
+        /* for INLINE */
+        struct
+          {
+            unsigned char kind;
+            unsigned char len;
+            char text[max_inline + 1];
+          }
+        in_;
+
+        /* for other kinds */
+        struct
+          {
+            unsigned char kind;
+            union
+              {
+                Mcr_body *body;
+                Mcr_built_in_func bi_func_ptr;
+                long int num;
+              };
+          }
+        out_;
       };
 
-    void clear_c_string()
+    int kind() const { return(in_.kind & ~(CONSTANT | PURE)); }
+
+    void clear()
       {
-        if (has_string_)
-          delete [] c_string_;
+        if (kind() == BODY)
+          release_body(out_.body);
+
+        in_.kind = NONE;
       }
 
     void set_c_string(const char *cs)
       {
-        char *tcs = new char [strlen(cs) + 1];
-
-        strcpy(tcs, cs);
+        size_t len = strlen(cs);
 
-        c_string_ = tcs;
+        if ((len <= max_inline) && !memchr(cs, '$', len))
+          {
+            in_.kind = INLINE;
+            in_.len = (unsigned char) len;
+            memcpy(in_.text, cs, len + 1);
+          }
+        else
+          {
+            out_.kind = BODY;
+            out_.body = new_body(cs, len);
+          }
+      }
 
-        has_string_ = true;
+    /* a copy is not constant, only mcr_set_constant() makes it so.  a
+       copy of a pure built-in macro is pure */
+    void copy(const Macro_value &src)
+      {
+        switch (src.kind())
+          {
+            case INLINE:
+              in_ = src.in_;
+              in_.kind = INLINE;
+              break;
+
+            case BODY:
+              out_.kind = BODY;
+              out_.body = src.out_.body;
+              ref_body(out_.body);
+              break;
+
+            case BUILT_IN:
+              out_.kind = BUILT_IN | (src.in_.kind & PURE);
+              out_.bi_func_ptr = src.out_.bi_func_ptr;
+              break;
+
+            case NUMBER:
+              out_.kind = NUMBER;
+              out_.num = src.out_.num;
+              break;
+
+            default:
+              in_.kind = NONE;
+          }
       }
 
   public:
 
-    Macro_value() : has_string_(false) { }
+    Macro_value() { in_.kind = NONE; }
 
     Macro_value(const char *c_str)
       {
         set_c_string(c_str);
       }
 
-    Macro_value(Mcr_built_in_func bi) : has_string_(false)
+    Macro_value(Mcr_built_in_func bi)
+      {
+        out_.kind = BUILT_IN;
+        out_.bi_func_ptr = bi;
+      }
+
+    Macro_value(long int n)
       {
-        bi_func_ptr_ = bi;
+        out_.kind = NUMBER;
+        out_.num = n;
       }
 
     ~Macro_value()
       {
-        clear_c_string();
+        clear();
       }
 
-    Macro_value(const Macro_value &src) = delete;
+    /* copies share the body */
+    Macro_value(const Macro_value &src)
+      {
+        copy(src);
+      }
 
-    Macro_value(Macro_value &&src) : has_string_(src.has_string_)
+    void operator = (const Macro_value &src)
       {
-        if (has_string_)
+        if (this != &src)
           {
-            c_string_ = src.c_string_;
-            src.has_string_ = false;
+            /* releasing the body first could free it */
+            if ((src.kind() == BODY) && (kind() == BODY) &&
+                (out_.body == src.out_.body))
+              return;
+
+            clear();
+            copy(src);
           }
-        else
-          bi_func_ptr_ = src.bi_func_ptr_;
       }
 
-    void operator = (const Macro_value &src) = delete;
+    /* false for a value which hides the definition of the macro in the
+       base of a context */
+    bool is_defined() const { return(kind() != NONE); }
+
+    bool has_string() const
+      { return((kind() == INLINE) || (kind() == BODY)); }
+
+    /* true if value is a number.  its text is the number in decimal,
+       which is only formed when needed */
+    bool is_number() const { return(kind() == NUMBER); }
+
+    long int number() const { return(out_.num); }
+
+    /* true if the macro is marked constant.  its expansion then only
+       depends on its arguments, and has no other effect */
+    bool is_constant() const { return((in_.kind & CONSTANT) != 0); }
+
+    void constant()
+      {
+        in_.kind |= CONSTANT;
+      }
+
+    bool is_built_in() const { return(kind() == BUILT_IN); }
+
+    /* true for a built-in macro whose result only depends on its
+       arguments, and which has no other effect, so it can be folded */
+    bool is_pure() const { return((in_.kind & PURE) != 0); }
+
+    void pure()
+      {
+        in_.kind |= PURE;
+      }
+
+    void number(long int n)
+      {
+        clear();
+
+        out_.kind = NUMBER;
+        out_.num = n;
+      }
 
-    void operator = (Macro_value &&src) = delete;
+    const char * c_string() const
+      { return((kind() == INLINE) ? in_.text : out_.body->text); }
 
-    bool has_string() const { return(has_string_); }
+    size_t length() const
+      { return((kind() == INLINE) ? in_.len : out_.body->len); }
 
-    const char * c_string() const { return(c_string_); }
+    /* body which must be evaluated, null if the string has no lead
+       character, so it can simply be copied to the result */
+    Mcr_body * body() const
+      {
+        return(((kind() == BODY) && out_.body->has_lead) ?
+               out_.body : nullptr);
+      }
 
     void c_string(const char *cs)
       {
-        clear_c_string();
+        clear();
 
         set_c_string(cs);
       }
 
-    Mcr_built_in_func bi_func_ptr() const { return(bi_func_ptr_); }
+    Mcr_built_in_func bi_func_ptr() const { return(out_.bi_func_ptr); }
 
     void bi_func_ptr(Mcr_built_in_func bifp)
       {
-        clear_c_string();
+        clear();
+
+        out_.kind = BUILT_IN;
+        out_.bi_func_ptr = bifp;
+      }
 
-        has_string_ = false;
-        bi_func_ptr_ = bifp;
+    /* mark the body, if any, as belonging to a frozen context or not */
+    void share(bool s) const
+      {
+        if (kind() == BODY)
+          {
+            out_.body->shared = s;
+            if (out_.body->fold != (Mcr_body *) 0)
+              out_.body->fold->shared = s;
+          }
       }
   };
 
-using SYM_TAB = std::unordered_map<std::string, Macro_value>;
+using SYM_TAB = Sym_tab<Macro_value>;
+
+/* bodies being inlined into, or done, when a context is frozen */
+enum { INLINE_BUSY, INLINE_DONE };
+using Mcr_inline_state = std::unordered_map<const Mcr_body *, int>;
 
-static SYM_TAB sym_tab;
+/* largest body inlined, in operations and characters */
+#define MAX_INLINE_OPS 16
+#define MAX_INLINE_LEN 256
+
+/* largest result of an invocation which is folded into a body, in
+   characters */
+#define MAX_FOLD_LEN 4*1024
+
+/* cache of compiled forms of text scheduled by built-in macros, keyed
+   by the text, with its CRC-32 as the hash.  the value is null for
+   text which cannot be compiled */
+using TEXT_TAB = Sym_tab<Mcr_body *>;
+
+/* maximum number of texts in the cache of a context */
+#define TEXT_CACHE_SIZE 256
+/* number of hashes of texts seen, which are not in the cache.  must be
+   a power of 2 */
+#define TEXT_SEEN_SIZE 1024
 
 /* success return value for functions */
 #define SUCCESS ((const char *) 0)
@@ -150,19 +483,425 @@ static SYM_TAB sym_tab;
 #define END2_QUOTE_ARG ((char) ')')
 #define EVAL_ARG_DELIM ((char) '!')
 
+/* structures for evaluation */
+
+/* size of first chunk of memory in an evaluation buffer area.  each
+   additional chunk is at least twice the size of the one before it */
+#define EVAL_CHUNK_SIZE 4*1024
+/* initial number of pointers to strings in an evaluation buffer area */
+#define N_EVAL_POINTERS 64
+
+/* size of the final result area of a function or file sink, and the
+   least amount the final result area of a string sink is grown by */
+#define SINK_BUF_SIZE 64*1024
+
+/* chunk of memory in an evaluation buffer area */
+struct eval_chunk
+  {
+    std::unique_ptr<char []> buf;
+    size_t size;
+  };
+
+/* position in an evaluation buffer area */
+struct eval_mark
+  {
+    /* index of chunk */
+    size_t chunk;
+    /* pointer into chunk */
+    char *free;
+  };
+
+/* evaluation buffer area */
+struct eval_area
+  {
+    /* chunks of memory to temporarily contain results of evaluation.
+       chunks after the current one are not in use, but are kept to
+       be reused */
+    std::vector<eval_chunk> chunk;
+    /* index of chunk strings are being added to */
+    size_t curr_chunk;
+    /* pointer to next free character in current chunk */
+    char *buf_free;
+    /* pointer past the end of the current chunk */
+    char *buf_end;
+    /* array of pointers to arguments in buffers */
+    std::vector<char *> ptr;
+    /* position in buffers where each string was begun.  if a string
+       is moved to a new chunk, this is where to resume adding
+       characters when the string is cleared */
+    std::vector<eval_mark> mark;
+    /* pointer to top pointer to an string (argument) */
+    char **curr_ptr;
+    /* pointer to last element of ptr */
+    char **last_ptr;
+  };
+
+/* record in nesting stack for evaluation */
+struct es_rec
+  {
+    /* state of evaluation */
+    int state;
+    /* select which evaluation buffer area results are going into */
+    int select;
+    /* number of arguments */
+    int n_arg;
+    /* pointer to array of arguments */
+    const char **arg;
+    /* flag telling if argument is being evaluated */
+    int arg_eval;
+    /* length and hash of macro name (the first argument) */
+    size_t name_len;
+    unsigned int name_hash;
+  };
+
+/* limit on level of nesting, to stop runaway recursion */
+#define MAX_NEST 100000
+
+/* kinds of input sources */
+
+/* characters passed to mcr_next_chars() */
+#define SRC_INPUT 0
+/* body of a string macro */
+#define SRC_BODY 1
+/* text to expand for a built-in macro */
+#define SRC_BUILT_IN 2
+
+/* record in stack of input sources */
+struct src_rec
+  {
+    /* kind of source */
+    int kind;
+    /* next character to evaluate */
+    const char *p;
+    /* end of characters to evaluate */
+    const char *end;
+    /* if source is a compiled body, the next operation to perform,
+       the end of the operations, and the text they refer to */
+    const Mcr_op *op;
+    const Mcr_op *op_end;
+    const char *op_text;
+    /* for SRC_BODY, the body being evaluated, and for SRC_BUILT_IN, the
+       compiled form of the text, or null.  the source holds a
+       reference to it */
+    Mcr_body *body;
+    /* for SRC_BODY, true if the operations are those of the folded
+       form of the body */
+    bool folded;
+    /* level of nesting the evaluation of the source began at.  for
+       SRC_BUILT_IN, this is the level above the arguments of the
+       built-in macro */
+    int level;
+    /* for SRC_BUILT_IN, function to call when source is exhausted */
+    Mcr_continuation cont;
+    /* counter to pass to cont */
+    long int count;
+  };
+
+/* state of an expansion.  the functions of the package which operate
+   on it are members */
+struct Mcr_context
+  {
+    Mcr_context(const Mcr_context *b);
+    ~Mcr_context();
+
+    /* macro definitions */
+    SYM_TAB sym_tab;
+
+    /* frozen context whose definitions are used for macros not defined
+       in this one, null if none */
+    const Mcr_context *base;
+
+    /* set when definitions can no longer be changed */
+    bool frozen;
+
+    /* set for the context built-in macros are called in to fold their
+       invocations.  names in numeric expressions are refused there, so
+       an invocation whose result depends on the values of macros is
+       not folded */
+    bool folding;
+
+    /* evaluation buffer areas */
+    eval_area eval[2];
+
+    /* final result for caller.  it accumulates in an area, and is
+       given to the sink when the area is full or the sink is flushed */
+    char *result;
+    /* free spaces in final result area */
+    size_t n_result;
+    /* start of the characters in the final result area not yet given
+       to the sink */
+    char *result_start;
+
+    /* if not null, the sink is this string, and the result area is
+       its end.  the characters before result are its contents */
+    std::string *sink_str;
+    /* otherwise, the function to give the result to, null to discard
+       it, and the data to pass to the function */
+    Mcr_sink_func sink_func;
+    void *sink_data;
+    /* file descriptor of file sink */
+    int sink_fd;
+    /* if set, the sink is flushed when a line is completed */
+    bool sink_line;
+    /* start of the characters in the final result area not yet
+       checked for the end of a line */
+    char *line_start;
+    /* final result area for function and file sinks */
+    std::unique_ptr<char []> sink_buf;
+
+    /* for an expansion whose input and result are pulled, the function
+       to get input from and the data to pass to it */
+    Mcr_source_func pull_src;
+    void *pull_data;
+    /* set when the input has ended */
+    bool pull_eof;
+    /* string sink the result is pulled from */
+    std::string pull_str;
+    /* while a chunk of the result is being pulled, the length wanted,
+       otherwise 0 */
+    size_t pull_chunk;
+
+    /* depth of nesting of quoted argument delimiters */
+    int depth_quote_arg_nest;
+
+    /* nesting stack for evaluation, grown as needed */
+    std::vector<es_rec> eval_stack;
+
+    /* pointers to current record in nesting stack, and the one above it */
+    es_rec *ep,*next_ep;
+
+    /* level of nesting */
+    int nest;
+
+    /* stack of input sources.  the top one is being evaluated */
+    std::vector<src_rec> src_stack;
+
+    /* level of nesting of the built-in macro function or continuation
+       being called, if it has not yet scheduled text to expand,
+       otherwise -1 */
+    int sched_level;
+
+    /* argument number being read */
+    unsigned int arg_no;
+
+    /* hash of macro name being read */
+    unsigned int name_hash;
+
+    /* set when a macro invocation has been completed */
+    int invoked;
+
+    /* set to end the innermost loop */
+    int break_flag;
+
+    /* number of macro invocations done */
+    unsigned long int n_invoked;
+
+    /* number of texts scheduled by built-in macros, and of those run
+       from compiled forms in the cache */
+    unsigned long int n_sched;
+    unsigned long int n_cached;
+
+    /* data for the caller */
+    void *user_data;
+
+    /* changed when the definition of a macro marked constant is
+       changed.  bodies folded before then are no longer used */
+    unsigned long int const_epoch;
+
+    /* compiled forms of text scheduled by built-in macros.  text is
+       only put in the cache when it is scheduled a second time, so
+       text formed from changing values does not displace others.  seen
+       holds hashes of texts scheduled, indexed by their low bits.
+       entries are removed in the order they were made, text_ring holds
+       them in that order, text_next is the index of the oldest */
+    TEXT_TAB text_tab;
+    TEXT_TAB::Entry *text_ring[TEXT_CACHE_SIZE];
+    size_t text_next;
+    uint32_t text_seen[TEXT_SEEN_SIZE];
+
+    const SYM_TAB::Entry *lookup(const char *name, size_t len,
+                                 unsigned int h) const;
+    void undefine(const char *name, size_t len, unsigned int h,
+                  SYM_TAB::Entry *e);
+    void unfold_sources(void);
+    void redefine(const char *name, size_t len, unsigned int h,
+                  const SYM_TAB::Entry *e);
+    bool fold_invoke(const Macro_value &v, int n_arg, const char **arg,
+                     std::string *res);
+    bool inline_invoke(Mcr_program *prog, size_t i, Mcr_inline_state *state);
+    void fold(Mcr_body *b, Mcr_inline_state *state);
+    void set_eval_free(int sel, size_t c, char *free);
+    void grow_buf(int sel, size_t n);
+    void set_nest(int n);
+    void grow_ptrs(int sel);
+    void pop_sources(size_t n);
+#if defined(DEBUG)
+    void print_es_rec(void);
+#endif
+    void start_expand(int n_orig_arg, const char **orig_arg);
+    const char *flush_sink(void);
+    const char *set_sink(std::string *str, Mcr_sink_func func, void *data,
+                         bool line);
+    const char *put_result(const char *p, size_t n);
+    const char *noeval_char(char c);
+    const char *noeval_span(const char *text, size_t len);
+    const char *end_built_in(int level);
+    const char *call_built_in(int level, Mcr_built_in_func func,
+                              Mcr_continuation cont, long int count);
+    Mcr_body *text_body(const char *text, size_t len);
+    const char *expand_text(const char *text, Mcr_continuation cont,
+                            long int count);
+    const char *invoke(void);
+    const char *eval_char(char c);
+    const char *end_source(void);
+    const char *exec_op(const Mcr_op *o, const char *text);
+    const char *run(size_t base);
+    const char *next_chars(const char *s, size_t n, size_t *n_used);
+    const char *start_pull(Mcr_source_func src, void *data,
+                           int n_orig_arg, const char **orig_arg);
+    const char *pull(size_t want, const char **text, size_t *len);
+  };
+
+
+/*
+  check that a macro name is valid, and get its length.
+*/
+static const char *check_name
+  (
+    const char *name,
+    size_t *len
+  )
+  {
+    const char *p;
+
+    p = name;
+    if (*p == (char) '\0')
+      return("empty macro name"); 
+    if (DIGIT(*p))
+      return("macro name cannot start with digit");
+    do
+      if (WHITE(*p))
+        return("macro name cannot contain white space");
+      else if (*p == RIGHT_DELIM)
+        return("macro name cannot contain right delimeter for invocation");
+    while (*(++p) != (char) '\0');
+
+    *len = size_t(p - name);
+
+    return(SUCCESS);
+  }
+
+
+/*
+  find the definition of a macro, in the context or its base.  returns
+  null if the macro is not defined.
+*/
+const SYM_TAB::Entry *Mcr_context::lookup
+  (
+    const char *name,
+    size_t len,
+    unsigned int h
+  ) const
+  {
+    const SYM_TAB::Entry *e = sym_tab.find(name, len, h);
+
+    if (e == (const SYM_TAB::Entry *) 0)
+      return(base ? base->lookup(name, len, h) : e);
+
+    return(e->value.is_defined() ? e : (const SYM_TAB::Entry *) 0);
+  }
+
+
+/*
+  delete the definition of a macro.  e is its entry in the symbol
+  table, or null if it has none.  if the base defines the macro, the
+  entry is kept to hide that definition.
+*/
+void Mcr_context::undefine
+  (
+    const char *name,
+    size_t len,
+    unsigned int h,
+    SYM_TAB::Entry *e
+  )
+  {
+    if (base && base->lookup(name, len, h))
+      {
+        if (e)
+          e->value = Macro_value();
+        else
+          sym_tab.insert(name, len, h);
+      }
+    else if (e)
+      sym_tab.erase(e);
+  }
+
+
+/*
+  called before the definition of a macro is changed.  e is its entry
+  in the symbol table, or null if it has none.  if the macro is
+  constant, the bodies folded using its definition become stale.
+*/
+void Mcr_context::redefine
+  (
+    const char *name,
+    size_t len,
+    unsigned int h,
+    const SYM_TAB::Entry *e
+  )
+  {
+    if (!e && base)
+      e = base->lookup(name, len, h);
+
+    if (e && e->value.is_constant())
+      {
+        const_epoch++;
+        unfold_sources();
+      }
+  }
+
+
+/*
+  called when the constant epoch changes.  bodies being evaluated in
+  their folded form continue in their original form, after the
+  invocation in progress (which is in both forms).
+*/
+void Mcr_context::unfold_sources(void)
+  {
+    const Mcr_op *o;
+    size_t next;
+
+
+    for (src_rec &s : src_stack)
+      if ((s.kind == SRC_BODY) && s.folded)
+        {
+          next = (s.op == body_op(s.body->fold)) ? 0 :
+                   (size_t((s.op - 1)->n) + 1);
+          o = body_op(s.body);
+          s.op = o + next;
+          s.op_end = o + s.body->n_op;
+          s.op_text = reinterpret_cast<const char *>(s.op_end);
+          s.folded = false;
+        }
+  }
+
+
+/* message for attempt to change the definitions of a frozen context */
+static const char frozen_msg[] = "macro definitions are frozen";
 
 /*
   define a macro
 */
 const char *mcr_def
   (
+    Mcr_context *ctx,
     /* name of macro */
     const char *name,
     /* body of definition */
     void *mval,
     /* if mgc != 0, the body of the macro is a string.  if mgc
        = 0, body is a pointer for a function whose proto-type is
-       const char *f(int n_arg,const char **arg);
+       const char *f(Mcr_context *ctx,int n_arg,const char **arg);
        this function is called when the macro is invoked, with
        the number of arguments to the macro and the
        array of arguments.  The first argument is the name
@@ -171,171 +910,586 @@ const char *mcr_def
     int mgc
   )
   {
-    const char *p;
+    size_t len;
+    const char *p = check_name(name,&len);
 
-    /* check name */
-    p = name;
-    if (*p == (char) '\0')
-      return("empty macro name"); 
-    if (DIGIT(*p))
-      return("macro name cannot start with digit");
-    do
-      if (WHITE(*p))
-        return("macro name cannot contain white space");
-      else if (*p == RIGHT_DELIM)
-        return("macro name cannot contain right delimeter for invocation");
-    while (*(++p) != (char) '\0');
+    if (p != SUCCESS)
+      return(p);
 
-    SYM_TAB::iterator i = sym_tab.find(name);
+    if (ctx->frozen)
+      return(frozen_msg);
+
+    unsigned int h = sym_hash(name, len);
+    SYM_TAB::Entry *e = ctx->sym_tab.find(name, len, h);
+
+    ctx->redefine(name, len, h, e);
 
     if ((mgc != 0) and ! *static_cast<char *>(mval))
       {
         // Macro is being deleted by setting it to the empty string.
 
-        if (i != sym_tab.end())
-          sym_tab.erase(i);
+        ctx->undefine(name, len, h, e);
 
         return(SUCCESS);
       }
 
-    if (i == sym_tab.end())
+    if (!e)
       {
         // New macro name.
         //
         if (mgc != 0)
-          i = sym_tab.emplace(name, static_cast<const char *>(mval)).first;
+          e = ctx->sym_tab.insert(name, len, h,
+                                  static_cast<const char *>(mval));
         else
-          i = sym_tab.emplace(name,
-                              reinterpret_cast<Mcr_built_in_func>(mval)).first;
+          ctx->sym_tab.insert(name, len, h,
+                         reinterpret_cast<Mcr_built_in_func>(mval));
       }
     else
       {
         // Macro already exists, change it's value.
         //
         if (mgc != 0)
-          i->second.c_string(static_cast<const char *>(mval));
+          e->value.c_string(static_cast<const char *>(mval));
         else
-          i->second.bi_func_ptr(reinterpret_cast<Mcr_built_in_func>(mval));
+          e->value.bi_func_ptr(reinterpret_cast<Mcr_built_in_func>(mval));
       }
 
+    if ((mgc != 0) && (e->value.body() != (Mcr_body *) 0))
+      ctx->fold(e->value.body(),(Mcr_inline_state *) 0);
+
     return(SUCCESS);
   }
 
 
 /*
-  dump names in macro table
+  define a pure built-in macro, which is constant
 */
-void mcr_dump(void)
+const char *mcr_def_pure
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name,
+    /* function called when the macro is invoked, as for mcr_def() */
+    void *func
+  )
   {
-    for (SYM_TAB::const_iterator i = sym_tab.cbegin(); i != sym_tab.cend();
-         ++i)
-      if (i->second.has_string())
-        printf("%s / %s\n", i->first.c_str(), i->second.c_string());
-      else
-        printf(
-          "%s / BUILTIN func addr = 0x%lx\n", i->first.c_str(),
-          reinterpret_cast<unsigned long>(i->second.bi_func_ptr()));
-  }
+    const char *p = mcr_def(ctx,name,func,0);
 
-/* structures for evaluation */
-#define EVAL_BUF_SIZE 4*1024
-#define N_EVAL_POINTERS 64
-static struct
-  {
-    /* buffer to temporarily contain results of evaluation */
-    char buf[EVAL_BUF_SIZE];
-    /* pointer to next free character in buffer */
-    char *buf_free;
-    /* array of pointers to arguments in buffers */
-    char *(ptr[N_EVAL_POINTERS]);
-    /* pointer to top pointer to an string (argument) */
-    char **curr_ptr;
-  }
-eval[2];
+    if (p != SUCCESS)
+      return(p);
 
-/* when eval[0].curr_ptr is null it is considered to be pointing
-   to the results area */
+    size_t len = strlen(name);
+    SYM_TAB::Entry *e = ctx->sym_tab.find(name, len, sym_hash(name, len));
 
-/* move to a new string */
-#define NEW_STRING(SELECT)  \
-  {  \
-    if (eval[(SELECT)].curr_ptr == (char **) 0)  \
-      eval[(SELECT)].curr_ptr = eval[(SELECT)].ptr;  \
-    else if (eval[(SELECT)].curr_ptr  \
-             == (eval[(SELECT)].ptr + N_EVAL_POINTERS))  \
-      return("buffer overflow while evaluating macro");  \
-    else  \
-      {  \
-        eval[(SELECT)].curr_ptr++;  \
-        *(eval[(SELECT)].curr_ptr) = eval[(SELECT)].buf_free;  \
-      }  \
+    e->value.pure();
+    e->value.constant();
+
+    return(SUCCESS);
   }
 
-/* add a character to the current string */
-#define ADD_CHAR(SELECT,CH)  \
+
+/*
+  define a macro to have the same definition as another
+*/
+const char *mcr_copy_def
+  (
+    Mcr_context *ctx,
+    /* name of macro to define */
+    const char *name,
+    /* name of macro whose definition is copied */
+    const char *from
+  )
+  {
+    size_t len;
+    const char *p = check_name(name,&len);
+
+    if (p != SUCCESS)
+      return(p);
+
+    if (ctx->frozen)
+      return(frozen_msg);
+
+    unsigned int h = sym_hash(name, len);
+    SYM_TAB::Entry *e = ctx->sym_tab.find(name, len, h);
+    size_t from_len = strlen(from);
+    const SYM_TAB::Entry *f =
+      ctx->lookup(from, from_len, sym_hash(from, from_len));
+
+    ctx->redefine(name, len, h, e);
+
+    if (!f)
+      {
+        // Like defining the macro as the empty string.
+
+        ctx->undefine(name, len, h, e);
+      }
+    else if (!e)
+      ctx->sym_tab.insert(name, len, h, f->value);
+    else
+      e->value = f->value;
+
+    return(SUCCESS);
+  }
+
+
+/*
+  define a macro whose body is the decimal text of a number
+*/
+const char *mcr_def_num
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name,
+    /* value of number */
+    long int num
+  )
+  {
+    size_t len;
+    const char *p = check_name(name,&len);
+
+    if (p != SUCCESS)
+      return(p);
+
+    if (ctx->frozen)
+      return(frozen_msg);
+
+    unsigned int h = sym_hash(name, len);
+    SYM_TAB::Entry *e = ctx->sym_tab.find(name, len, h);
+
+    ctx->redefine(name, len, h, e);
+
+    if (!e)
+      ctx->sym_tab.insert(name, len, h, num);
+    else
+      e->value.number(num);
+
+    return(SUCCESS);
+  }
+
+
+/*
+  mark a macro as constant
+*/
+const char *mcr_set_constant
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name
+  )
+  {
+    size_t len;
+    const char *p = check_name(name,&len);
+
+    if (p != SUCCESS)
+      return(p);
+
+    if (ctx->frozen)
+      return(frozen_msg);
+
+    unsigned int h = sym_hash(name, len);
+    SYM_TAB::Entry *e = ctx->sym_tab.find(name, len, h);
+    const SYM_TAB::Entry *f = ctx->lookup(name, len, h);
+
+    if (!f)
+      return("only a defined macro can be constant");
+
+    /* a built-in function may have other effects, or need the data of
+       the context it is called in */
+    if (f->value.is_built_in() && !f->value.is_pure())
+      return("only a pure built-in macro can be constant");
+
+    /* a definition from the base is copied, to be marked */
+    if (!e)
+      e = ctx->sym_tab.insert(name, len, h, f->value);
+
+    e->value.constant();
+
+    return(SUCCESS);
+  }
+
+
+/*
+  get the value of a macro defined by mcr_def_num()
+*/
+int mcr_num_value
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name,
+    /* set to value of number */
+    long int *num
+  )
+  {
+    size_t len = strlen(name);
+    const SYM_TAB::Entry *e = ctx->lookup(name, len, sym_hash(name, len));
+
+    if ((e == (const SYM_TAB::Entry *) 0) || !e->value.is_number())
+      return(0);
+
+    *num = e->value.number();
+
+    return(1);
+  }
+
+
+/*
+  get the value of a macro for a name in a numeric expression
+*/
+int mcr_name_value
+  (
+    Mcr_context *ctx,
+    const char *name,
+    size_t len,
+    long int *num
+  )
+  {
+    const SYM_TAB::Entry *e;
+    const char *s, *end;
+    bool neg = false;
+    unsigned long int n;
+
+    /* no name has a value while an invocation is folded */
+    if (ctx->folding)
+      return(0);
+
+    e = ctx->lookup(name, len, sym_hash(name, len));
+    if (e == (const SYM_TAB::Entry *) 0)
+      return(0);
+
+    if (e->value.is_number())
+      {
+        *num = e->value.number();
+        return(1);
+      }
+
+    if (!e->value.has_string())
+      return(0);
+
+    /* the body must be the decimal text of a number, with optional
+       sign and white space around it */
+    s = e->value.c_string();
+    end = s + e->value.length();
+    while ((s != end) && ((*s == ' ') || (*s == '\t') || (*s == '\n')))
+      s++;
+    if ((s != end) && ((*s == '-') || (*s == '+')))
+      neg = *(s++) == '-';
+    if ((s == end) || (*s < '0') || (*s > '9'))
+      return(0);
+    for (n = 0; (s != end) && (*s >= '0') && (*s <= '9'); s++)
+      n = (n * 10UL) + (unsigned long int) (*s - '0');
+    while ((s != end) && ((*s == ' ') || (*s == '\t') || (*s == '\n')))
+      s++;
+    if (s != end)
+      return(0);
+
+    *num = (long int) (neg ? (0UL - n) : n);
+
+    return(1);
+  }
+
+
+/* maximum number of characters in the decimal text of a long int */
+#define MAX_NUM_TEXT (((sizeof(long int) * CHAR_BIT) / 3) + 2)
+
+/*
+  form the decimal text of a number, ending just before end.  returns
+  a pointer to the first character of the text.
+*/
+static char *format_num
+  (
+    long int num,
+    char *end
+  )
+  {
+    static const char pair[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233"
+      "34353637383940414243444546474849505152535455565758596061626364656667"
+      "6869707172737475767778798081828384858687888990919293949596979899";
+
+    unsigned long int u =
+      (num < 0) ? (0UL - (unsigned long int) num) : (unsigned long int) num;
+    char *p = end;
+
+
+    /* two digits at a time */
+    while (u >= 100)
+      {
+        unsigned int i = (unsigned int) (u % 100) * 2;
+
+        u /= 100;
+        *(--p) = pair[i + 1];
+        *(--p) = pair[i];
+      }
+
+    if (u >= 10)
+      {
+        *(--p) = pair[u * 2 + 1];
+        *(--p) = pair[u * 2];
+      }
+    else
+      *(--p) = (char) ('0' + u);
+
+    if (num < 0)
+      *(--p) = '-';
+
+    return(p);
+  }
+
+
+/*
+  dump names in macro table
+*/
+void mcr_dump
+  (
+    Mcr_context *ctx
+  )
+  {
+    /* definitions in a base are dumped if not hidden by the context */
+    for (const Mcr_context *c = ctx; c; c = c->base)
+      c->sym_tab.for_each(
+        [ctx](const SYM_TAB::Entry &e)
+          {
+            if (ctx->lookup(e.name, e.len, e.hash) != &e)
+              return;
+
+            if (e.value.has_string())
+              printf("%s / %s\n", e.name, e.value.c_string());
+            else if (e.value.is_number())
+              printf("%s / %ld\n", e.name, e.value.number());
+            else
+              printf(
+                "%s / BUILTIN func addr = 0x%lx\n", e.name,
+                reinterpret_cast<unsigned long>(e.value.bi_func_ptr()));
+          });
+  }
+
+/* when eval[0].curr_ptr is null it is considered to be pointing
+   to the results area */
+
+/* move to a new string */
+#define NEW_STRING(SELECT)  \
+  {  \
+    if (eval[(SELECT)].curr_ptr == (char **) 0)  \
+      eval[(SELECT)].curr_ptr = eval[(SELECT)].ptr.data();  \
+    else  \
+      {  \
+        if (eval[(SELECT)].curr_ptr == eval[(SELECT)].last_ptr)  \
+          grow_ptrs(SELECT);  \
+        eval[(SELECT)].curr_ptr++;  \
+      }  \
+    *(eval[(SELECT)].curr_ptr) = eval[(SELECT)].buf_free;  \
+    {  \
+      eval_mark &m = eval[(SELECT)].mark[size_t(eval[(SELECT)].curr_ptr  \
+                                                - eval[(SELECT)].ptr.data())];  \
+      m.chunk = eval[(SELECT)].curr_chunk;  \
+      m.free = eval[(SELECT)].buf_free;  \
+    }  \
+  }
+
+/* add a character to the current string */
+#define ADD_CHAR(SELECT,CH)  \
+  {  \
+    if (((SELECT) == 0) && (eval[0].curr_ptr == (char **) 0))  \
+      {  \
+        if (n_result == 0)  \
+          {  \
+            char ch_ = (CH);  \
+            const char *rv_ = put_result(&ch_,1);  \
+            if (rv_ != SUCCESS)  \
+              return(rv_);  \
+          }  \
+        else  \
+          {  \
+            *(result++) = (CH);  \
+            n_result--;  \
+          }  \
+      }  \
+    else  \
+      {  \
+        if (eval[(SELECT)].buf_free == eval[(SELECT)].buf_end)  \
+          grow_buf((SELECT),1);  \
+        *(eval[(SELECT)].buf_free++) = (CH);  \
+      }  \
+  }
+
+/* add N characters starting at P to the current string */
+#define ADD_SPAN(SELECT,P,N)  \
   {  \
     if (((SELECT) == 0) && (eval[0].curr_ptr == (char **) 0))  \
       {  \
-        if (mcr_n_result == 0)  \
-          return("result buffer overflow while evaluating macro");  \
+        if (n_result < size_t(N))  \
+          {  \
+            const char *rv_ = put_result((P),size_t(N));  \
+            if (rv_ != SUCCESS)  \
+              return(rv_);  \
+          }  \
         else  \
           {  \
-            *(mcr_result++) = (CH);  \
-            mcr_n_result--;  \
+            memcpy(result,(P),(N));  \
+            result += (N);  \
+            n_result -= size_t(N);  \
           }  \
       }  \
-    else if (eval[(SELECT)].buf_free > (eval[(SELECT)].buf + EVAL_BUF_SIZE))  \
-      return("buffer overflow while evaluating macro");  \
     else  \
-      *(eval[(SELECT)].buf_free++) = (CH);  \
+      {  \
+        if (size_t(eval[(SELECT)].buf_end - eval[(SELECT)].buf_free)  \
+            < size_t(N))  \
+          grow_buf((SELECT),size_t(N));  \
+        memcpy(eval[(SELECT)].buf_free,(P),(N));  \
+        eval[(SELECT)].buf_free += (N);  \
+      }  \
   }
 
 /* get pointer to current string pointer.  */
 #define CURR_PTR(SELECT) (eval[(SELECT)].curr_ptr)
 
-/* clear N strings from the top of the stack */
+/* clear N strings from the top of the stack.  the memory they used
+   is reused for the following strings, chunks are not freed */
 #define CLEAR(SELECT,N)  \
   {  \
-    if  ((eval[(SELECT)].ptr + (N)) > eval[(SELECT)].curr_ptr)  \
+    if  ((eval[(SELECT)].ptr.data() + (N)) > eval[(SELECT)].curr_ptr)  \
       {  \
         eval[(SELECT)].curr_ptr = (char **) 0;  \
-        eval[(SELECT)].buf_free = eval[(SELECT)].buf;  \
+        set_eval_free((SELECT),0,eval[(SELECT)].chunk[0].buf.get());  \
       }  \
     else  \
       {  \
         eval[(SELECT)].curr_ptr -= (N);  \
-        eval[(SELECT)].buf_free = *(eval[(SELECT)].curr_ptr + 1);  \
+        const eval_mark &m = eval[(SELECT)].mark[size_t(  \
+            eval[(SELECT)].curr_ptr + 1 - eval[(SELECT)].ptr.data())];  \
+        set_eval_free((SELECT),m.chunk,m.free);  \
       }  \
   }
 
-/* depth of nesting of quoted argument delimiters */
-static int depth_quote_arg_nest;
+/*
+  set the position in evaluation buffer area sel where the next
+  character will be added.
+*/
+inline void Mcr_context::set_eval_free
+  (
+    int sel,
+    /* index of chunk */
+    size_t c,
+    /* pointer into chunk */
+    char *free
+  )
+  {
+    eval[sel].curr_chunk = c;
+    eval[sel].buf_free = free;
+    eval[sel].buf_end = eval[sel].chunk[c].buf.get() + eval[sel].chunk[c].size;
+  }
+
+/*
+  make room for n more characters in the current string of evaluation
+  buffer area sel.  the current string is moved to the start of the next
+  chunk, which is allocated if there is not already a big enough one.
+  strings must stay contiguous, and only the current string (at the top
+  of the stack) can be added to, so no other string needs to move.
+*/
+void Mcr_context::grow_buf
+  (
+    int sel,
+    size_t n
+  )
+  {
+    char *s = eval[sel].curr_ptr ? *eval[sel].curr_ptr : eval[sel].buf_free;
+    size_t len = size_t(eval[sel].buf_free - s);
+    size_t c = eval[sel].curr_chunk + 1;
+    std::vector<eval_chunk> &chunk = eval[sel].chunk;
+
+
+    if ((c < chunk.size()) && (chunk[c].size < (len + n)))
+      /* spare chunk is too small, free it and the ones after it */
+      chunk.resize(c);
+
+    if (c == chunk.size())
+      {
+        eval_chunk ch;
+
+        ch.size = 2 * chunk[c - 1].size;
+        if (ch.size < (2 * (len + n)))
+          ch.size = 2 * (len + n);
+        ch.buf.reset(new char [ch.size]);
+        chunk.push_back(std::move(ch));
+      }
+
+    memcpy(chunk[c].buf.get(), s, len);
+    if (eval[sel].curr_ptr)
+      *eval[sel].curr_ptr = chunk[c].buf.get();
+
+    set_eval_free(sel, c, chunk[c].buf.get() + len);
+  }
+
 
-/* maximum amount of nesting */
-#define MAX_NEST 64
+/*
+  make the record at level n of the nesting stack current, growing the
+  stack if necessary.  pointers into the stack are invalidated.
+*/
+void Mcr_context::set_nest
+  (
+    int n
+  )
+  {
+    /* room for the record above the current one, and the one above
+       that used for argument evaluation */
+    if (eval_stack.size() < size_t(n + 3))
+      eval_stack.resize(2 * size_t(n + 3));
+
+    nest = n;
+    ep = eval_stack.data() + n;
+    next_ep = ep + 1;
+  }
 
-/* nesting stack for evaluation, and pointers into it */
-static struct es_rec
+/*
+  double the number of pointers to strings in evaluation buffer area
+  sel.  the arguments of a macro are a contiguous array of these
+  pointers, so pointers to arguments in the nesting stack are moved
+  along with them.
+*/
+void Mcr_context::grow_ptrs
+  (
+    int sel
+  )
   {
-    /* state of evaluation */
-    int state;
-    /* select which evaluation buffer area results are going into */
-    int select;
-    /* number of arguments */
-    int n_arg;
-    /* pointer to array of arguments */
-    const char **arg;
-    /* flag telling if argument is being evaluated */
-    int arg_eval;
-  } 
-eval_stack[MAX_NEST],*ep,*next_ep;
+    char **old = eval[sel].ptr.data();
+    size_t n = eval[sel].ptr.size();
+    char **p;
+    const char **a = const_cast<const char **>(old);
+
+
+    eval[sel].ptr.resize(2 * n);
+    eval[sel].mark.resize(2 * n);
 
-/* level of nesting */
-static int nest;
+    p = eval[sel].ptr.data();
+    eval[sel].curr_ptr = p + (eval[sel].curr_ptr - old);
+    eval[sel].last_ptr = p + (2 * n - 1);
+
+    for (es_rec &r : eval_stack)
+      if ((r.arg >= a) && (r.arg < (a + n)))
+        r.arg = const_cast<const char **>(p) + (r.arg - a);
+  }
+
+
+/*
+  pop sources off the source stack until n are left.
+*/
+void Mcr_context::pop_sources
+  (
+    size_t n
+  )
+  {
+    while (src_stack.size() > n)
+      {
+        if (src_stack.back().body != (Mcr_body *) 0)
+          release_body(src_stack.back().body);
+
+        src_stack.pop_back();
+      }
+  }
 
 #if defined(DEBUG)
 
-static void print_es_rec(void)
+void Mcr_context::print_es_rec(void)
   {
     int i;
 
@@ -349,13 +1503,13 @@ static void print_es_rec(void)
       fprintf(stderr,"no active strings\n");
     else
       fprintf(stderr,"%ld active strings\n",
-        ((long int) (eval[ep->select].curr_ptr - eval[ep->select].ptr)) + 1L);
+        ((long int) (eval[ep->select].curr_ptr - eval[ep->select].ptr.data())) + 1L);
     i = 1 - ep->select;
     if (eval[i].curr_ptr == (char **) 0)
       fprintf(stderr,"other: no active strings\n");
     else
       fprintf(stderr,"other: %ld active strings\n",
-        ((long int) (eval[i].curr_ptr - eval[i].ptr)) + 1L);
+        ((long int) (eval[i].curr_ptr - eval[i].ptr.data())) + 1L);
 
     return;
   }
@@ -378,443 +1532,2312 @@ static void print_es_rec(void)
 #define BEGIN1_SEEN_WITHIN_ARG 11
 #define END1_QUOTE_ARG_SEEN 12
 
-/* argument number being read */
-static unsigned int arg_no;
+/* operation codes for compiled macro bodies */
+
+/* copy text to result */
+#define OP_LIT 0
+/* copy argument to result */
+#define OP_ARG 1
+/* start invocation of macro with the text as the name */
+#define OP_NAME 2
+/* add the text as a quoted argument */
+#define OP_QUOTED 3
+/* begin evaluation of an argument */
+#define OP_EVAL_ARG 4
+/* end evaluation of an argument */
+#define OP_END_ARG 5
+/* invoke the macro */
+#define OP_INVOKE 6
+
+/*
+  add an operation to a program being compiled.
+*/
+static void add_op
+  (
+    Mcr_program *prog,
+    int code,
+    unsigned int n,
+    const std::string &text
+  )
+  {
+    Mcr_op o;
 
-/* body of macro which is "evaluated" when an 
-   undefined macro is referenced */
-const Macro_value mcr_empty("");
 
+    o.code = code;
+    o.n = n;
+    o.offset = (unsigned int) prog->text.size();
+    o.len = (unsigned int) text.size();
+    prog->op.push_back(o);
+    prog->text += text;
+  }
 
 /*
-  function to begin expansion
+  compile a macro body.  this follows the same state transitions as
+  eval_char(), but records operations instead of performing them.
+  returns false if the body is not made up of complete macro
+  invocations and argument references, or has a syntax error.  such
+  bodies must be evaluated a character at a time.
 */
-void mcr_start_expand
+static bool compile
   (
-    /* number of top level arguments */
-    int n_orig_arg,
-    /* array of top level arguments */
-    const char **orig_arg
+    const char *body,
+    /* program to fill in */
+    Mcr_program *prog
   )
   {
-    nest = 0;
+    /* state of a nesting level */
+    struct level
+      {
+        int state;
+        int arg_eval;
+      };
+
+    std::vector<level> lv(1);
+    level *lp;
+    /* literal text not yet added to program */
+    std::string lit;
+    /* name or quoted argument being collected */
+    std::string tok;
+    unsigned int no = 0;
+    int depth = 0;
+    char c;
+
+
+    lv[0].state = NORMAL;
+    lv[0].arg_eval = 0;
+
+    prog->op.clear();
+    prog->text.clear();
+
+    /* flush literal text before adding another operation */
+#define FLUSH_LIT  \
+  if (!lit.empty())  \
+    {  \
+      add_op(prog,OP_LIT,0,lit);  \
+      lit.clear();  \
+    }
+
+    for ( ; (c = *body) != (char) '\0'; body++)
+      for ( ; ; )
+        {
+          lp = &lv.back();
+          switch (lp->state)
+            {
+              case NORMAL:
+                if (c == LEAD)
+                  lp->state = LEAD_SEEN;
+                else if ((lp->arg_eval) && (c == EVAL_ARG_DELIM))
+                  lp->state = DELIM_SEEN_EVAL_ARG;
+                else
+                  lit += c;
+
+                break;
+
+              case DELIM_SEEN_EVAL_ARG:
+                if (c == EVAL_ARG_DELIM)
+                  {
+                    lit += EVAL_ARG_DELIM;
+                    lp->state = NORMAL;
+                  }
+                else
+                  {
+                    FLUSH_LIT
+                    add_op(prog,OP_END_ARG,0,std::string());
+                    lv.pop_back();
+                    continue;
+                  }
+
+                break;
+
+              case LEAD_SEEN:
+                if (c == LEAD)
+                  lp->state = LEAD_AGAIN;
+                else if (c == LEFT_DELIM)
+                  lp->state = WAIT_NAME;
+                else
+                  {
+                    lit += LEAD;
+                    lp->state = NORMAL;
+                    continue;
+                  }
+
+                break;
+
+              case LEAD_AGAIN:
+                if (c == LEFT_DELIM)
+                  {
+                    lit += LEAD;
+                    lit += LEFT_DELIM;
+                    lp->state = NORMAL;
+                  }
+                else
+                  {
+                    lit += LEAD;
+                    lp->state = LEAD_SEEN;
+                    continue;
+                  }
+                break;
+
+              case WAIT_NAME:
+                if (DIGIT(c))
+                  {
+                    lp->state = GETTING_ARG_NO;
+                    no = ((unsigned int) c) - ((unsigned int) '0');
+                  }
+                else if (!WHITE(c))
+                  {
+                    lp->state = GETTING_NAME;
+                    tok = c;
+                  }
+
+                break;
+
+              case GETTING_ARG_NO:
+                if (DIGIT(c))
+                  {
+                    no *= 10;
+                    no += ((unsigned int) c) - ((unsigned int) '0');
+
+                    if (no > (INT_MAX / 10))
+                      goto fail;
+                  }
+                else
+                  {
+                    FLUSH_LIT
+                    add_op(prog,OP_ARG,no,std::string());
+                    lp->state = WAIT_ARG_END;
+                    continue;
+                  }
+                break;
+
+              case WAIT_ARG_END:
+                if (c == RIGHT_DELIM)
+                  lp->state = NORMAL;
+                else if (!WHITE(c))
+                  goto fail;
+
+                break;
+
+              case GETTING_NAME:
+                if ((!WHITE(c)) && (c != RIGHT_DELIM))
+                  tok += c;
+                else
+                  {
+                    FLUSH_LIT
+                    add_op(prog,OP_NAME,sym_hash(tok.data(),tok.size()),tok);
+                    lp->state = WAIT_ARG_OR_MACRO_END;
+                    continue;
+                  }
+
+                break;
+
+              case WAIT_ARG_OR_MACRO_END:
+                if (c == EVAL_ARG_DELIM)
+                  {
+                    add_op(prog,OP_EVAL_ARG,0,std::string());
+                    lv.emplace_back();
+                    lv.back().state = NORMAL;
+                    lv.back().arg_eval = 1;
+                  }
+                else if (c == RIGHT_DELIM)
+                  {
+                    add_op(prog,OP_INVOKE,0,std::string());
+                    lp->state = NORMAL;
+                  }
+                else if (c == BEGIN1_QUOTE_ARG)
+                  lp->state = BEGIN1_QUOTE_ARG_SEEN;
+                else if (!WHITE(c))
+                  goto fail;
+
+                break;
+
+              case BEGIN1_QUOTE_ARG_SEEN:
+                if (c == BEGIN2_QUOTE_ARG)
+                  {
+                    tok.clear();
+                    depth = 1;
+                    lp->state = GETTING_QUOTED_ARG;
+                  }
+                else
+                  goto fail;
+
+                break;
+
+              case GETTING_QUOTED_ARG:
+                if (c == END1_QUOTE_ARG)
+                  lp->state = END1_QUOTE_ARG_SEEN;
+                else
+                  {
+                    if (c == BEGIN1_QUOTE_ARG)
+                      lp->state = BEGIN1_SEEN_WITHIN_ARG;
+
+                    tok += c;
+                  }
+
+                break;
+
+              case BEGIN1_SEEN_WITHIN_ARG:
+                tok += c;
+                if (c == BEGIN2_QUOTE_ARG)
+                  depth++;
+                if (c != BEGIN1_QUOTE_ARG)
+                  lp->state = GETTING_QUOTED_ARG;
+
+                break;
+
+              case END1_QUOTE_ARG_SEEN:
+                if (c == END2_QUOTE_ARG)
+                  {
+                    if (depth == 1)
+                      {
+                        add_op(prog,OP_QUOTED,0,tok);
+                        lp->state = WAIT_ARG_OR_MACRO_END;
+                      }
+                    else
+                      {
+                        tok += END1_QUOTE_ARG;
+                        tok += END2_QUOTE_ARG;
+                        depth--;
+                        lp->state = GETTING_QUOTED_ARG;
+                      }
+                  }
+                else
+                  {
+                    tok += END1_QUOTE_ARG;
+                    tok += c;
+                    if (c != END1_QUOTE_ARG)
+                      lp->state = GETTING_QUOTED_ARG;
+                  }
+                break;
+            } /* switch */
 
-    ep = eval_stack;
-    next_ep = eval_stack + 1;
+          break;
+        }
 
-    ep->state = NORMAL;
-    ep->select = 0;
-    ep->n_arg = n_orig_arg;
-    ep->arg = orig_arg;
-    ep->arg_eval = 0;
+#undef FLUSH_LIT
 
-    eval[0].buf_free =  eval[0].buf;
-    /* make results area current string */
-    eval[0].curr_ptr = (char **) 0;
-    eval[0].ptr[0] = eval[0].buf;
-    eval[1].buf_free = eval[1].buf;
-    eval[1].curr_ptr = (char **) 0;
-    eval[1].ptr[0] = eval[1].buf;
+    if ((lv.size() != 1) || (lv[0].state != NORMAL))
+      goto fail;
 
-    return;
+    if (!lit.empty())
+      add_op(prog,OP_LIT,0,lit);
+
+    return(true);
+
+  fail:
+
+    return(false);
   }
 
+
+/* body of macro which is "evaluated" when an 
+   undefined macro is referenced */
+const Macro_value mcr_empty("");
+
+
 /*
-  insert a character directly into the output
-  stream without evaluating it
+  add literal text to a program, joining it to the text of the last
+  operation if that is also literal
 */
-const char *mcr_noeval_char
+static void add_lit
   (
-    char c
+    Mcr_program *prog,
+    const char *p,
+    size_t n
   )
   {
-    ADD_CHAR(ep->select, c);
-    return((const char *) 0);
+    if (n == 0)
+      return;
+
+    if (!prog->op.empty() && (prog->op.back().code == OP_LIT))
+      {
+        prog->op.back().len += (unsigned int) n;
+        prog->text.append(p, n);
+      }
+    else
+      add_op(prog,OP_LIT,0,std::string(p, n));
   }
 
 
 /*
-  next character to evaluate.
+  sink for the result of a built-in macro whose invocation is folded.
+  data points to the string the result is added to.  fails if the
+  result is too long to fold.
 */
-const char *mcr_next_char
+static const char *fold_sink
   (
-    char c
+    void *data,
+    const char *text,
+    size_t len
   )
   {
-    if (c == (char) '\0')
-      return("null character in input to macro processor");
+    std::string *res = static_cast<std::string *>(data);
 
-    switch (ep->state)
+    if (len > MAX_FOLD_LEN - res->size())
+      return("result too long to fold");
+
+    res->append(text,len);
+
+    return(SUCCESS);
+  }
+
+
+/*
+  get the result of an invocation of a constant macro whose arguments
+  are known.  returns false if it cannot be known before the
+  invocation, or if it is longer than MAX_FOLD_LEN, so the invocation
+  is left in the body.
+*/
+bool Mcr_context::fold_invoke
+  (
+    /* definition of the macro */
+    const Macro_value &v,
+    /* number of arguments, including the name */
+    int n_arg,
+    const char **arg,
+    /* set to the result */
+    std::string *res
+  )
+  {
+    res->clear();
+
+    if (v.is_number())
       {
-        case NORMAL:
-          if (c == LEAD)
-            ep->state = LEAD_SEEN;
-          else if ((ep->arg_eval) && (c == EVAL_ARG_DELIM))
-            ep->state = DELIM_SEEN_EVAL_ARG;
-          else
-            ADD_CHAR(ep->select,c);
+        char buf[MAX_NUM_TEXT];
+        const char *p = format_num(v.number(),buf + MAX_NUM_TEXT);
 
-          break;
+        res->assign(p,size_t((buf + MAX_NUM_TEXT) - p));
 
-        case DELIM_SEEN_EVAL_ARG:
-          if (c == EVAL_ARG_DELIM)
-            /* escape of delimiter */
-            {
-              ADD_CHAR(ep->select,EVAL_ARG_DELIM)
-              ep->state = NORMAL;
-            }
-          else
-            /* done evaluating an argument */
-            {
-              /* terminate string */
-              ADD_CHAR(ep->select,(char) '\0')
+        return(true);
+      }
 
-              /* go back to pointing to level below macro */
-              nest -= 2;
-              ep -= 2;
-              next_ep -=2;
+    if (v.has_string())
+      {
+        Mcr_body *b = v.body();
+
+        if ((b != (Mcr_body *) 0) && (b->fold != (Mcr_body *) 0) &&
+            (b->fold_epoch == const_epoch))
+          b = b->fold;
+
+        if (b == (Mcr_body *) 0)
+          res->assign(v.c_string(),v.length());
+        else if (!b->has_lead)
+          res->assign(b->text,b->len);
+        else if (b->n_op == 0)
+          return(false);
+        else
+          {
+            /* only a body of literal text and argument references can
+               be done here */
+            const Mcr_op *o = body_op(b), *end = o + b->n_op;
+            const char *text = reinterpret_cast<const char *>(end);
+
+            for ( ; o != end; o++)
+              if (o->code == OP_LIT)
+                res->append(text + o->offset,o->len);
+              else if (o->code != OP_ARG)
+                return(false);
+              else if (int(o->n) < n_arg)
+                res->append(arg[o->n]);
+          }
 
-              /* process current charater */
-              return(mcr_next_char(c));
-            }
+        return(res->size() <= MAX_FOLD_LEN);
+      }
 
-          break;
+    /* built-in macro.  only a pure one is called, in a context of its
+       own, since this one may be in the midst of an expansion.  text
+       it schedules cannot be expanded there, so that fails.  its result
+       goes to a sink which fails when it is too long */
+    thread_local std::unique_ptr<Mcr_context> scratch;
+    thread_local bool busy;
+    const char *p,*q;
+
+    if (busy || !v.is_pure())
+      return(false);
+    if (!scratch)
+      {
+        scratch.reset(new Mcr_context((const Mcr_context *) 0));
+        scratch->folding = true;
+      }
 
-        case LEAD_SEEN:
-          if (c == LEAD)
-            /* not a macro invocation, may be an escape */
-            ep->state = LEAD_AGAIN;
-          else if (c == LEFT_DELIM)
-            /* macro invocation */
-            ep->state = WAIT_NAME;
-          else
-            /* isolated lead character */
-            {
-              ADD_CHAR(ep->select,LEAD)
-              ep->state = NORMAL;
-              /* process current charater */
-              return(mcr_next_char(c));
-            }
+    busy = true;
+    scratch->start_expand(0,(const char **) 0);
+    (void) scratch->set_sink((std::string *) 0,fold_sink,(void *) res,
+                             false);
+    p = v.bi_func_ptr()(scratch.get(),n_arg,arg);
+    q = scratch->set_sink((std::string *) 0,(Mcr_sink_func) 0,(void *) 0,
+                          false);
+    busy = false;
 
-          break;
+    return((p == SUCCESS) && (q == SUCCESS));
+  }
 
-        case LEAD_AGAIN:
-          if (c == LEFT_DELIM)
-            /* escape sequence to result */
-            {
-              ADD_CHAR(ep->select,LEAD)
-              ADD_CHAR(ep->select,LEFT_DELIM)
-              ep->state = NORMAL;
-            }
-          else
-            {
-              /* not escape of lead-in sequence; put first lead
-                 characters in result */
-              ADD_CHAR(ep->select,LEAD)
-              ep->state = LEAD_SEEN;
-              return(mcr_next_char(c));
-            }
-          break;
 
-        case WAIT_NAME:
-          if (DIGIT(c))
-            {
-              ep->state = GETTING_ARG_NO;
-              arg_no = ((unsigned int) c) - ((unsigned int) '0');
-            }
-          else if (!WHITE(c))
-            {
-              ep->state = GETTING_NAME;
+/*
+  replace an invocation at the end of a program being folded by the
+  body of the macro, with its argument references replaced by the
+  arguments.  this is only done for a small macro defined in this
+  context, whose body is literal text and references to its arguments,
+  and when the arguments are literal text and references to arguments
+  of the body being folded.  i is the index of the name of the
+  invocation.  returns false if the invocation cannot be inlined.
+*/
+bool Mcr_context::inline_invoke
+  (
+    Mcr_program *prog,
+    size_t i,
+    Mcr_inline_state *state
+  )
+  {
+    /* operations of an argument */
+    struct arg_ops
+      {
+        size_t begin,end;
+        bool quoted;
+      };
 
-              /* initialize argument information */
-              next_ep->n_arg = 1;
-              NEW_STRING(1 - ep->select)
-              next_ep->arg =
-                const_cast<const char **>(CURR_PTR(1 - ep->select));
+    std::vector<arg_ops> arg;
+    arg_ops a;
+    Mcr_program saved;
+    SYM_TAB::Entry *e;
+    Mcr_body *cb;
+    const Mcr_op *o, *end;
+    const char *text;
+    size_t j, k;
+    bool has_arg = false;
+
+
+    e = sym_tab.find(prog->text.data() + prog->op[i].offset,prog->op[i].len,
+                     prog->op[i].n);
+    if ((e == (SYM_TAB::Entry *) 0) || !e->value.has_string() ||
+        (e->value.body() == (Mcr_body *) 0))
+      return(false);
+
+    /* the body, optimized first */
+    cb = e->value.body();
+    fold(cb,state);
+    if ((*state)[cb] != INLINE_DONE)
+      /* recursive */
+      return(false);
+    if ((cb->fold != (Mcr_body *) 0) && (cb->fold_epoch == const_epoch))
+      cb = cb->fold;
+    if (!cb->has_lead || (cb->n_op == 0) || (cb->n_op > MAX_INLINE_OPS) ||
+        (cb->len > MAX_INLINE_LEN))
+      return(false);
+
+    /* a body which is only literal text is left alone, the macro is
+       likely a variable */
+    for (o = body_op(cb), end = o + cb->n_op; o != end; o++)
+      if (o->code == OP_ARG)
+        has_arg = true;
+      else if (o->code != OP_LIT)
+        return(false);
+    if (!has_arg)
+      return(false);
+
+    /* get the arguments.  the name is the first, it is like a quoted
+       argument */
+    a.begin = i;
+    a.end = i + 1;
+    a.quoted = true;
+    arg.push_back(a);
+    for (j = i + 1; j < prog->op.size(); j = k)
+      {
+        if (prog->op[j].code == OP_QUOTED)
+          {
+            a.begin = j;
+            a.end = k = j + 1;
+            a.quoted = true;
+          }
+        else if (prog->op[j].code == OP_EVAL_ARG)
+          {
+            a.begin = j + 1;
+            a.quoted = false;
+            for (k = j + 1; prog->op[k].code != OP_END_ARG; k++)
+              if ((prog->op[k].code != OP_LIT) && (prog->op[k].code != OP_ARG))
+                return(false);
+            a.end = k++;
+          }
+        else
+          return(false);
 
-              ADD_CHAR(1 - ep->select,c)
-            }
+        arg.push_back(a);
+      }
 
-          break;
+    /* replace the invocation */
+    saved.op.assign(prog->op.begin() + long(i),prog->op.end());
+    saved.text = prog->text.substr(prog->op[i].offset);
+    for (Mcr_op &so : saved.op)
+      so.offset -= prog->op[i].offset;
+    prog->text.resize(prog->op[i].offset);
+    prog->op.resize(i);
 
-        case GETTING_ARG_NO:
-          if (DIGIT(c))
-            {
-              arg_no *= 10;
-              arg_no += ((unsigned int) c) - ((unsigned int) '0');
+    /* the arguments are now in saved, the name is the first */
+    for (j = 0; j < arg.size(); j++)
+      {
+        arg[j].begin -= i;
+        arg[j].end -= i;
+      }
 
-              if (arg_no > (INT_MAX / 10))
-                return("ridiculous macro argument number");
-            }
+    text = reinterpret_cast<const char *>(body_op(cb) + cb->n_op);
+    for (o = body_op(cb), end = o + cb->n_op; o != end; o++)
+      if (o->code == OP_LIT)
+        add_lit(prog,text + o->offset,o->len);
+      else if (o->n >= arg.size())
+        /* argument not given, it is null */
+        ;
+      else if (arg[o->n].quoted)
+        add_lit(prog,saved.text.data() + saved.op[arg[o->n].begin].offset,
+                saved.op[arg[o->n].begin].len);
+      else
+        for (j = arg[o->n].begin; j < arg[o->n].end; j++)
+          if (saved.op[j].code == OP_LIT)
+            add_lit(prog,saved.text.data() + saved.op[j].offset,
+                    saved.op[j].len);
           else
-            {
-              const char *p;
+            add_op(prog,saved.op[j].code,saved.op[j].n,std::string());
 
-              if (int(arg_no) < ep->n_arg)
-                {
-                  /* copy value of argument into result */
-                  p = (ep->arg)[arg_no];
-                  while (*p != (char) '\0')
-                    {
-                      ADD_CHAR(ep->select,*p)
-                      p++;
-                    }
-                }
+    /* the body only depends on the arguments, so the macro is constant.
+       this also makes changing its definition in a derived context stop
+       the use of the bodies it was inlined into */
+    e->value.constant();
 
-              /* if argument number too large, argument considered
-                 to be null */
+    return(true);
+  }
 
-              ep->state = WAIT_ARG_END;
-              return(mcr_next_char(c));
-            }
-          break;
 
-        case WAIT_ARG_END:
-          if (c == RIGHT_DELIM)
-            /* argument invocation has ended */
-            ep->state = NORMAL;
-          else if (!WHITE(c))
-            return("unexpected garbage in macro argument reference");
+/*
+  fold a compiled body.  invocations of constant macros whose arguments
+  are known are replaced by their results, innermost first, so an
+  invocation whose arguments are such invocations is also replaced.
+  an invocation which is not replaced keeps the index of its operation
+  in the body, so an evaluation of the folded body can continue in the
+  body after it (see unfold_sources()).  the folded body, if any, is
+  kept with the body.  if state is not null, the context is being
+  frozen, and invocations of small macros are also inlined.  state
+  then tells which bodies have been done.
+*/
+void Mcr_context::fold
+  (
+    Mcr_body *b,
+    Mcr_inline_state *state
+  )
+  {
+    Mcr_program prog;
+    /* indexes in prog of the names of invocations not yet complete */
+    std::vector<size_t> name_op;
+    std::vector<std::string> arg_text;
+    std::vector<const char *> arg;
+    std::string res;
+    const Mcr_op *o = body_op(b), *end = o + b->n_op;
+    const char *text = reinterpret_cast<const char *>(end);
+    const SYM_TAB::Entry *e;
+    bool folded = false;
+    size_t i, j;
+
+
+    if (state != (Mcr_inline_state *) 0)
+      {
+        if (state->count(b) != 0)
+          return;
+        (*state)[b] = INLINE_BUSY;
+      }
 
-          break;
+    for ( ; o != end; o++)
+      {
+        if (o->code == OP_LIT)
+          {
+            add_lit(&prog,text + o->offset,o->len);
+            continue;
+          }
 
-        case GETTING_NAME:
-          if ((!WHITE(c)) && (c != RIGHT_DELIM))
-            ADD_CHAR(1 - ep->select,c)
-          else
-            /* good termination of name, get definition */
-            {
-              /* null terminate name */
-              ADD_CHAR(1 - ep->select,(char) '\0')
+        if (o->code == OP_NAME)
+          name_op.push_back(prog.op.size());
+        else if (o->code == OP_INVOKE)
+          {
+            i = name_op.back();
+            name_op.pop_back();
+
+            /* the arguments must all be literal text */
+            arg_text.assign(1,prog.text.substr(prog.op[i].offset,
+                                               prog.op[i].len));
+            for (j = i + 1; j < prog.op.size(); j++)
+              if (prog.op[j].code == OP_QUOTED)
+                arg_text.push_back(prog.text.substr(prog.op[j].offset,
+                                                    prog.op[j].len));
+              else if ((prog.op[j].code == OP_EVAL_ARG) &&
+                       (j + 1 < prog.op.size()) &&
+                       (prog.op[j + 1].code == OP_END_ARG))
+                {
+                  arg_text.push_back(std::string());
+                  j++;
+                }
+              else if ((prog.op[j].code == OP_EVAL_ARG) &&
+                       (j + 2 < prog.op.size()) &&
+                       (prog.op[j + 1].code == OP_LIT) &&
+                       (prog.op[j + 2].code == OP_END_ARG))
+                {
+                  arg_text.push_back(prog.text.substr(prog.op[j + 1].offset,
+                                                      prog.op[j + 1].len));
+                  j += 2;
+                }
+              else
+                break;
+
+            e = (j == prog.op.size()) ?
+                  lookup(arg_text[0].data(),arg_text[0].size(),prog.op[i].n) :
+                  (const SYM_TAB::Entry *) 0;
+            if ((e != (const SYM_TAB::Entry *) 0) && e->value.is_constant())
+              {
+                arg.clear();
+                for (const std::string &t : arg_text)
+                  arg.push_back(t.c_str());
+
+                /* the offsets and lengths of operations are unsigned
+                   ints, so the text must not grow past UINT_MAX */
+                if (fold_invoke(e->value,int(arg.size()),arg.data(),&res) &&
+                    (res.size() <= UINT_MAX - prog.op[i].offset))
+                  {
+                    /* replace the invocation by its result */
+                    prog.text.resize(prog.op[i].offset);
+                    prog.op.resize(i);
+                    add_lit(&prog,res.data(),res.size());
+                    folded = true;
+
+                    continue;
+                  }
+              }
+
+            if ((state != (Mcr_inline_state *) 0) &&
+                inline_invoke(&prog,i,state))
+              {
+                folded = true;
+
+                continue;
+              }
+
+            add_op(&prog,OP_INVOKE,(unsigned int) (o - body_op(b)),
+                   std::string());
+            continue;
+          }
 
-#if defined(DEBUG)
+        add_op(&prog,o->code,o->n,std::string(text + o->offset,o->len));
+      }
 
-              (void) fprintf(stderr,"\nMACRO %s SEEN\n",
-                             *CURR_PTR(1 - ep->select));
+    if (state != (Mcr_inline_state *) 0)
+      {
+        (*state)[b] = INLINE_DONE;
 
-#endif
+        /* the body is folded again, when frozen */
+        if (b->fold != (Mcr_body *) 0)
+          {
+            release_body(b->fold);
+            b->fold = (Mcr_body *) 0;
+          }
+      }
 
-              ep->state = WAIT_ARG_OR_MACRO_END;
-              return(mcr_next_char(c));
-            }
+    if (!folded)
+      return;
 
-          break;
+    if (prog.op.empty())
+      b->fold = make_body("",0,false,(const Mcr_program *) 0);
+    else if ((prog.op.size() == 1) && (prog.op[0].code == OP_LIT))
+      /* all literal text, which is copied as is */
+      b->fold = make_body(prog.text.data(),prog.text.size(),false,
+                          (const Mcr_program *) 0);
+    else
+      b->fold = make_body(b->text,b->len,true,&prog);
+    b->fold_epoch = const_epoch;
+  }
 
-        case WAIT_ARG_OR_MACRO_END:
-          if (c == EVAL_ARG_DELIM)
-            {
-              struct es_rec *tmp_ep;
 
-              next_ep->n_arg++;
-              NEW_STRING(1 - ep->select)
+/*
+  create context, with no macros defined other than those of its base
+*/
+Mcr_context::Mcr_context
+  (
+    /* frozen context, or null */
+    const Mcr_context *b
+  )
+  : base(b), frozen(false), folding(false), result((char *) 0), n_result(0),
+    result_start((char *) 0), sink_str((std::string *) 0),
+    sink_func((Mcr_sink_func) 0), sink_data((void *) 0), sink_fd(-1),
+    sink_line(false), line_start((char *) 0),
+    pull_src((Mcr_source_func) 0), pull_data((void *) 0), pull_eof(true),
+    pull_chunk(0), depth_quote_arg_nest(0),
+    sched_level(-1), arg_no(0), name_hash(0), invoked(0), break_flag(0),
+    n_invoked(0), n_sched(0), n_cached(0), user_data((void *) 0),
+    const_epoch(b ? b->const_epoch : 0),
+    text_ring(), text_next(0), text_seen()
+  {
+    for (int sel = 0; sel < 2; sel++)
+      {
+        eval_chunk ch;
 
-              if (nest >= MAX_NEST - 2)
-                return("macro nesting level too deep");
+        ch.size = EVAL_CHUNK_SIZE;
+        ch.buf.reset(new char [ch.size]);
+        eval[sel].chunk.push_back(std::move(ch));
 
-              /* record two above current one is for evaluation
-                 of macro argument */
-              tmp_ep = ep + 2;
+        eval[sel].ptr.resize(N_EVAL_POINTERS);
+        eval[sel].mark.resize(N_EVAL_POINTERS);
+        eval[sel].last_ptr = eval[sel].ptr.data() + (N_EVAL_POINTERS - 1);
+      }
 
-              /* fill in record for argument evaluation */
-              tmp_ep->state = NORMAL;
-              tmp_ep->select = 1 - ep->select;
-              tmp_ep->n_arg = ep->n_arg;
-              tmp_ep->arg = ep->arg;
-              tmp_ep->arg_eval = 1;
+    /* result is discarded until a sink is given */
+    (void) set_sink((std::string *) 0,(Mcr_sink_func) 0,(void *) 0,false);
 
-              /* now evaluating the argument, make its evaluation
-                 stack record current */
-              ep += 2;
-              next_ep += 2;
-              nest += 2;
+    start_expand(0,(const char **) 0);
+  }
 
-#if defined(DEBUG)
 
-              (void) fprintf(stderr,"\nEVAL MACRO ARG\n");
-              print_es_rec();
+/*
+  destroy context
+*/
+Mcr_context::~Mcr_context()
+  {
+    /* end any expansion, releasing the bodies being evaluated */
+    pop_sources(0);
+
+    text_tab.for_each(
+      [](const TEXT_TAB::Entry &e)
+        {
+          if (e.value != (Mcr_body *) 0)
+            release_body(e.value);
+        });
+
+    /* the bodies of a frozen context are only referred to by it now */
+    if (frozen)
+      sym_tab.for_each(
+        [](const SYM_TAB::Entry &e) { e.value.share(false); });
+  }
 
-#endif
-            }
-          else if (c == RIGHT_DELIM)
-            /* macro invocation completed; time to evaluate it */
-            {
-              if (nest == (MAX_NEST - 1))
-                return("macro nesting level too deep");
 
-              /* lookup name */
-              auto i = sym_tab.find(next_ep->arg[0]);
+/*
+  function to begin expansion
+*/
+void Mcr_context::start_expand
+  (
+    /* number of top level arguments */
+    int n_orig_arg,
+    /* array of top level arguments */
+    const char **orig_arg
+  )
+  {
+    set_nest(0);
 
-	      const Macro_value *to_eval;
+    ep->state = NORMAL;
+    ep->select = 0;
+    ep->n_arg = n_orig_arg;
+    ep->arg = orig_arg;
+    ep->arg_eval = 0;
 
-              if (i == sym_tab.end())
-                to_eval = &mcr_empty;
-              else
-                to_eval = &(i->second);
+    pop_sources(0);
+    sched_level = -1;
+    break_flag = 0;
 
-              const char *p,*rv;
+    for (int sel = 0; sel < 2; sel++)
+      {
+        /* for eval[0], make results area current string */
+        eval[sel].curr_ptr = (char **) 0;
+        set_eval_free(sel,0,eval[sel].chunk[0].buf.get());
+      }
 
-              if (to_eval->has_string())
-                /* normal evaluation */
-                {
-                  /* finalize record for macro evaluation */
-                  next_ep->state = NORMAL;
-                  next_ep->select = ep->select;
-                  next_ep->arg_eval = 0;
+    return;
+  }
 
-                  p = to_eval->c_string();
+/*
+  insert a character directly into the output
+  stream without evaluating it
+*/
+const char *Mcr_context::noeval_char
+  (
+    char c
+  )
+  {
+    ADD_CHAR(ep->select, c);
+    return((const char *) 0);
+  }
 
-                  /* now evaluating the macro body, make its evaluation
-                     stack record current */
-                  ep++;
-                  next_ep++;
-                  nest++;
+/*
+  insert a span of characters directly into the output
+  stream without evaluating them
+*/
+const char *Mcr_context::noeval_span
+  (
+    const char *text,
+    size_t len
+  )
+  {
+    ADD_SPAN(ep->select, text, len);
+    return((const char *) 0);
+  }
 
-#if defined(DEBUG)
 
-                  (void) fprintf(stderr,"\nEVAL MACRO BODY %s\n",p);
-                  print_es_rec();
+/*
+  give the characters in the final result area to the sink, and empty
+  the area
+*/
+const char *Mcr_context::flush_sink(void)
+  {
+    const char *rv = SUCCESS;
 
-#endif
 
-                  while (*p != (char) '\0')
-                    {
-                      rv = mcr_next_char(*(p++));
-                      if (rv != SUCCESS)
-                        return(rv);
-                    }
+    if (sink_str != (std::string *) 0)
+      {
+        /* trim the string to its contents.  the area is grown again
+           when more characters are added */
+        sink_str->resize(size_t(result - &(*sink_str)[0]));
+        result = &(*sink_str)[0] + sink_str->size();
+        n_result = 0;
+      }
+    else
+      {
+        if ((result != result_start) && (sink_func != (Mcr_sink_func) 0))
+          rv = sink_func(sink_data,result_start,size_t(result - result_start));
+        result = sink_buf.get();
+        n_result = SINK_BUF_SIZE;
+      }
 
-                  CLEAR(1 - ep->select,ep->n_arg)
-                  ep--;
-                  next_ep--;
-                  nest--;
-                }
-              else
-                /* magic macro, call its function */
-                {
-                  struct es_rec *tmp_ep;
+    result_start = line_start = result;
 
-                  /* re-create argument evaluation environment, so
-                     macros like "if" can evaluate arguments that
-                     were quoted */
+    return(rv);
+  }
 
-                  if (nest >= MAX_NEST - 2)
-                    return("macro nesting level too deep");
 
-                  /* record two above current one is for evaluation
-                     of macro argument */
-                  tmp_ep = ep;
-                  ep += 2;
-                  next_ep += 2;
-                  nest += 2;
-                  ep->state = NORMAL;
-                  ep->select = tmp_ep->select;
-                  ep->n_arg = tmp_ep->n_arg;
-                  ep->arg = tmp_ep->arg;
-                  ep->arg_eval = 0;
-#if defined(DEBUG)
+/*
+  flush the current sink, then make the final result go to a new one
+*/
+const char *Mcr_context::set_sink
+  (
+    /* string sink, or null */
+    std::string *str,
+    /* if str is null, the function to give the result to, null to
+       discard it */
+    Mcr_sink_func func,
+    /* data to pass to func */
+    void *data,
+    /* if set, flush the sink when a line is completed */
+    bool line
+  )
+  {
+    const char *rv = SUCCESS;
 
-                  (void) fprintf(stderr,"\nEVAL MAGIC MACRO\n");
-                  print_es_rec();
 
-#endif
-                  rv = (to_eval->bi_func_ptr())(
-                         (tmp_ep + 1)->n_arg,(tmp_ep + 1)->arg);
-                  if (rv != SUCCESS)
-                    return(rv);
+    if (result != (char *) 0)
+      rv = flush_sink();
 
-                  nest -= 2;
-                  ep -= 2;
-                  next_ep -=2;
+    sink_str = str;
+    sink_func = func;
+    sink_data = data;
+    sink_line = line;
+    if ((str == (std::string *) 0) && !sink_buf)
+      sink_buf.reset(new char [SINK_BUF_SIZE]);
 
-                  /* clear arguments */
-                  CLEAR(1 - ep->select,next_ep->n_arg)
-                }
+    if (str != (std::string *) 0)
+      {
+        /* the result area starts out empty, it is grown when a
+           character is added */
+        result = &(*str)[0] + str->size();
+        n_result = 0;
+      }
+    else
+      {
+        result = sink_buf.get();
+        n_result = SINK_BUF_SIZE;
+      }
+    result_start = line_start = result;
 
-              ep->state = NORMAL;
-            }
-          else if (c == BEGIN1_QUOTE_ARG)
-            ep->state = BEGIN1_QUOTE_ARG_SEEN;
-          else if (!WHITE(c))
-            return("unexpected garbage in macro invocation");
-          
-          break;
+    return(rv);
+  }
 
-        case BEGIN1_QUOTE_ARG_SEEN:
-          if (c == BEGIN2_QUOTE_ARG)
-            {
-              next_ep->n_arg++;
-              NEW_STRING(1 - ep->select)
 
-              depth_quote_arg_nest = 1;
+/*
+  add characters to the final result which do not fit in the final
+  result area
+*/
+const char *Mcr_context::put_result
+  (
+    const char *p,
+    size_t n
+  )
+  {
+    const char *rv;
 
-              ep->state = GETTING_QUOTED_ARG;
-            }
-          else
-            return("unexpected garbage in macro invocation");
 
-          break;
+    if (sink_str != (std::string *) 0)
+      {
+        /* grow the string, the new end of it is the result area */
+        size_t len = size_t(result - &(*sink_str)[0]);
 
-        case GETTING_QUOTED_ARG:
-          if (c == END1_QUOTE_ARG)
-            ep->state = END1_QUOTE_ARG_SEEN;
-          else
-            {
-              if (c == BEGIN1_QUOTE_ARG)
-                ep->state = BEGIN1_SEEN_WITHIN_ARG;
+        sink_str->resize(len + ((n > SINK_BUF_SIZE) ? n : SINK_BUF_SIZE));
+        result = &(*sink_str)[0] + len;
+        n_result = sink_str->size() - len;
+      }
+    else
+      {
+        rv = flush_sink();
+        if (rv != SUCCESS)
+          return(rv);
+
+        if (n >= SINK_BUF_SIZE)
+          /* give large spans to the sink without copying them */
+          return((sink_func == (Mcr_sink_func) 0) ? SUCCESS :
+                 sink_func(sink_data,p,n));
+      }
 
-              ADD_CHAR(1 - ep->select,c)
-            }
+    memcpy(result,p,n);
+    result += n;
+    n_result -= n;
 
-          break;
+    return(SUCCESS);
+  }
 
-        case BEGIN1_SEEN_WITHIN_ARG:
-          ADD_CHAR(1 - ep->select,c)
-          if (c == BEGIN2_QUOTE_ARG)
-            depth_quote_arg_nest++;
-          if (c != BEGIN1_QUOTE_ARG)
-            ep->state = GETTING_QUOTED_ARG;
 
-          break;
+/*
+  finish the invocation of a built-in macro.  level is the level
+  above its arguments.
+*/
+const char *Mcr_context::end_built_in
+  (
+    int level
+  )
+  {
+    set_nest(level - 2);
 
-        case END1_QUOTE_ARG_SEEN:
-          if (c == END2_QUOTE_ARG)
-            {
-              if (depth_quote_arg_nest == 1)
-                /* argument has been terminated */
-                {
-                  /* terminate argument string */
-                  ADD_CHAR(1 - ep->select,(char) '\0')
+    /* clear arguments */
+    CLEAR(1 - ep->select,next_ep->n_arg)
 
-                  ep->state = WAIT_ARG_OR_MACRO_END;
-                }
-              else
-                {
-                  ADD_CHAR(1 - ep->select,END1_QUOTE_ARG)
-                  ADD_CHAR(1 - ep->select,END2_QUOTE_ARG)
-                  depth_quote_arg_nest--;
-                  ep->state = GETTING_QUOTED_ARG;
-                }
-            }
-          else
-            /* false alarm */
-            {
-              ADD_CHAR(1 - ep->select,END1_QUOTE_ARG)
-              ADD_CHAR(1 - ep->select,c)
-              if (c != END1_QUOTE_ARG)
-                ep->state = GETTING_QUOTED_ARG;
-            }
-          break;
-      } /* switch */
+    ep->state = NORMAL;
+    invoked = 1;
 
     return(SUCCESS);
   }
 
 
 /*
-  boolean function - returns non-zero if in midst of
-  a macro expansion.
+  call a built-in macro function, or a continuation scheduled by
+  one.  if no text to expand was scheduled, finish the invocation.
 */
-int mcr_expanding(void)
+const char *Mcr_context::call_built_in
+  (
+    /* level above arguments of built-in macro */
+    int level,
+    /* built-in function to call, if cont is null */
+    Mcr_built_in_func func,
+    /* continuation to call */
+    Mcr_continuation cont,
+    /* counter to pass to continuation */
+    long int count
+  )
+  {
+    const char *rv;
+    int save_sched_level = sched_level;
+    const es_rec &args = eval_stack[size_t(level - 1)];
+
+
+    sched_level = level;
+    if (cont == (Mcr_continuation) 0)
+      rv = func(this,args.n_arg,args.arg);
+    else
+      rv = cont(this,args.n_arg,args.arg,count);
+
+    if (rv != SUCCESS)
+      return(rv);
+
+    if (sched_level == -1)
+      /* text to expand was scheduled */
+      rv = SUCCESS;
+    else
+      rv = end_built_in(level);
+
+    sched_level = save_sched_level;
+
+    return(rv);
+  }
+
+
+/*
+  get the compiled form of text scheduled by a built-in macro (the
+  body of a loop, for example) from the cache, compiling it if it has
+  been scheduled recently, so it is not analyzed again each time it is
+  expanded.  a reference is added to the body returned.  returns null
+  if the text is to be evaluated a character at a time.
+*/
+Mcr_body *Mcr_context::text_body
+  (
+    const char *text,
+    size_t len
+  )
+  {
+    thread_local Mcr_program prog;
+    uint32_t h, *seen;
+    TEXT_TAB::Entry *e, **old;
+
+
+    /* text with no macro invocations is copied in bulk anyway */
+    if (memchr(text,LEAD,len) == (const void *) 0)
+      return((Mcr_body *) 0);
+
+    h = crc32(0,text,len);
+    e = text_tab.find(text,len,h);
+    if (e == (TEXT_TAB::Entry *) 0)
+      {
+        seen = text_seen + (h & (TEXT_SEEN_SIZE - 1));
+        if (*seen != h)
+          {
+            /* not scheduled recently, do not compile */
+            *seen = h;
+            return((Mcr_body *) 0);
+          }
+
+        old = text_ring + text_next;
+        if (*old != (TEXT_TAB::Entry *) 0)
+          {
+            /* remove the oldest entry */
+            if ((*old)->value != (Mcr_body *) 0)
+              release_body((*old)->value);
+            text_tab.erase(*old);
+          }
+
+        e = text_tab.insert(text,len,h,
+                            compile(text,&prog) ?
+                              make_body(text,len,true,&prog) :
+                              (Mcr_body *) 0);
+        *old = e;
+        text_next = (text_next + 1) % TEXT_CACHE_SIZE;
+      }
+
+    if (e->value != (Mcr_body *) 0)
+      ref_body(e->value);
+
+    return(e->value);
+  }
+
+
+/*
+  schedule text to be expanded in place of the invocation of a
+  built-in macro.
+*/
+const char *Mcr_context::expand_text
+  (
+    /* text to expand */
+    const char *text,
+    /* function to call when text has been expanded, may be null */
+    Mcr_continuation cont,
+    /* counter to pass to cont */
+    long int count
+  )
+  {
+    src_rec s;
+    size_t len;
+
+
+    if (sched_level != nest)
+      return("text to expand not scheduled by built-in macro");
+
+    len = strlen(text);
+
+    s.kind = SRC_BUILT_IN;
+    s.body = text_body(text,len);
+    n_sched++;
+    if (s.body != (Mcr_body *) 0)
+      {
+        n_cached++;
+        /* the source holds a reference to the compiled form */
+        s.p = s.end = (const char *) 0;
+        s.op = body_op(s.body);
+        s.op_end = s.op + s.body->n_op;
+        s.op_text = reinterpret_cast<const char *>(s.op_end);
+      }
+    else
+      {
+        s.p = text;
+        s.end = text + len;
+        s.op = s.op_end = (const Mcr_op *) 0;
+      }
+    s.folded = false;
+    s.level = nest;
+    s.cont = cont;
+    s.count = count;
+    src_stack.push_back(s);
+
+    sched_level = -1;
+
+    return(SUCCESS);
+  }
+
+
+/*
+  invoke the macro whose name and arguments have been collected in the
+  record above the current one in the nesting stack.
+*/
+const char *Mcr_context::invoke(void)
+  {
+    if (nest >= MAX_NEST)
+      return("macro nesting level too deep");
+
+    n_invoked++;
+
+    /* lookup name */
+    const SYM_TAB::Entry *e =
+      lookup(next_ep->arg[0],next_ep->name_len,next_ep->name_hash);
+
+    const Macro_value *to_eval;
+    Mcr_body *orig, *b;
+
+    if (e == (const SYM_TAB::Entry *) 0)
+      to_eval = &mcr_empty;
+    else
+      to_eval = &(e->value);
+
+    /* the folded body is used, unless a constant macro it depends on
+       has been redefined since it was folded */
+    orig = b = to_eval->has_string() ? to_eval->body() : (Mcr_body *) 0;
+    if ((b != (Mcr_body *) 0) && (b->fold != (Mcr_body *) 0) &&
+        (b->fold_epoch == const_epoch))
+      b = b->fold;
+
+    if (to_eval->is_number())
+      /* copy text of number to the result */
+      {
+        char buf[MAX_NUM_TEXT];
+        const char *p = format_num(to_eval->number(),buf + MAX_NUM_TEXT);
+
+        ADD_SPAN(ep->select,p,size_t((buf + MAX_NUM_TEXT) - p))
+
+        /* clear arguments */
+        CLEAR(1 - ep->select,next_ep->n_arg)
+
+        ep->state = NORMAL;
+        invoked = 1;
+      }
+    else if (to_eval->has_string() && (b == (Mcr_body *) 0))
+      /* body has no macro invocations or argument references, copy it
+         to the result */
+      {
+        ADD_SPAN(ep->select,to_eval->c_string(),to_eval->length())
+
+        /* clear arguments */
+        CLEAR(1 - ep->select,next_ep->n_arg)
+
+        ep->state = NORMAL;
+        invoked = 1;
+      }
+    else if (to_eval->has_string() && !b->has_lead)
+      /* folded to literal text */
+      {
+        ADD_SPAN(ep->select,b->text,b->len)
+
+        /* clear arguments */
+        CLEAR(1 - ep->select,next_ep->n_arg)
+
+        ep->state = NORMAL;
+        invoked = 1;
+      }
+    else if (to_eval->has_string())
+      /* normal evaluation */
+      {
+        src_rec s;
+
+        /* finalize record for macro evaluation */
+        next_ep->state = NORMAL;
+        next_ep->select = ep->select;
+        next_ep->arg_eval = 0;
+
+        /* now evaluating the macro body, make its evaluation
+           stack record current */
+        set_nest(nest + 1);
+
+        s.kind = SRC_BODY;
+        if (b->n_op != 0)
+          {
+            s.p = s.end = (const char *) 0;
+            s.op = body_op(b);
+            s.op_end = s.op + b->n_op;
+            s.op_text = reinterpret_cast<const char *>(s.op_end);
+          }
+        else
+          {
+            s.p = b->text;
+            s.end = s.p + b->len;
+            s.op = s.op_end = (const Mcr_op *) 0;
+          }
+        s.level = nest;
+
+        /* the body stays in existence while it is being evaluated,
+           even if the macro is redefined.  the original body is held,
+           so the evaluation can continue in it if the folded form
+           becomes stale */
+        ref_body(orig);
+        s.body = orig;
+        s.folded = (b != orig);
+        src_stack.push_back(s);
+
+#if defined(DEBUG)
+
+        (void) fprintf(stderr,"\nEVAL MACRO BODY %s\n",to_eval->c_string());
+        print_es_rec();
+
+#endif
+      }
+    else
+      /* magic macro, call its function */
+      {
+        es_rec *tmp_ep;
+
+        /* re-create argument evaluation environment, so
+           macros like "if" can evaluate arguments that
+           were quoted */
+
+        /* record two above current one is for evaluation
+           of macro argument */
+        set_nest(nest + 2);
+        tmp_ep = ep - 2;
+        ep->state = NORMAL;
+        ep->select = tmp_ep->select;
+        ep->n_arg = tmp_ep->n_arg;
+        ep->arg = tmp_ep->arg;
+        ep->arg_eval = 0;
+#if defined(DEBUG)
+
+        (void) fprintf(stderr,"\nEVAL MAGIC MACRO\n");
+        print_es_rec();
+
+#endif
+        return(call_built_in(nest,to_eval->bi_func_ptr(),
+                             (Mcr_continuation) 0,0L));
+      }
+
+    return(SUCCESS);
+  }
+
+
+/*
+  evaluate a character.
+*/
+const char *Mcr_context::eval_char
+  (
+    char c
+  )
+  {
+    if (c == (char) '\0')
+      return("null character in input to macro processor");
+
+    /* loop is repeated when the current character must be processed
+       again in a new state */
+    for ( ; ; )
+      {
+        switch (ep->state)
+          {
+            case NORMAL:
+              if (c == LEAD)
+                ep->state = LEAD_SEEN;
+              else if ((ep->arg_eval) && (c == EVAL_ARG_DELIM))
+                ep->state = DELIM_SEEN_EVAL_ARG;
+              else
+                ADD_CHAR(ep->select,c);
+
+              break;
+
+            case DELIM_SEEN_EVAL_ARG:
+              if (c == EVAL_ARG_DELIM)
+                /* escape of delimiter */
+                {
+                  ADD_CHAR(ep->select,EVAL_ARG_DELIM)
+                  ep->state = NORMAL;
+                }
+              else
+                /* done evaluating an argument */
+                {
+                  /* terminate string */
+                  ADD_CHAR(ep->select,(char) '\0')
+
+                  /* go back to pointing to level below macro */
+                  set_nest(nest - 2);
+
+                  /* process current charater */
+                  continue;
+                }
+
+              break;
+
+            case LEAD_SEEN:
+              if (c == LEAD)
+                /* not a macro invocation, may be an escape */
+                ep->state = LEAD_AGAIN;
+              else if (c == LEFT_DELIM)
+                /* macro invocation */
+                ep->state = WAIT_NAME;
+              else
+                /* isolated lead character */
+                {
+                  ADD_CHAR(ep->select,LEAD)
+                  ep->state = NORMAL;
+                  /* process current charater */
+                  continue;
+                }
+
+              break;
+
+            case LEAD_AGAIN:
+              if (c == LEFT_DELIM)
+                /* escape sequence to result */
+                {
+                  ADD_CHAR(ep->select,LEAD)
+                  ADD_CHAR(ep->select,LEFT_DELIM)
+                  ep->state = NORMAL;
+                }
+              else
+                {
+                  /* not escape of lead-in sequence; put first lead
+                     characters in result */
+                  ADD_CHAR(ep->select,LEAD)
+                  ep->state = LEAD_SEEN;
+                  continue;
+                }
+              break;
+
+            case WAIT_NAME:
+              if (DIGIT(c))
+                {
+                  ep->state = GETTING_ARG_NO;
+                  arg_no = ((unsigned int) c) - ((unsigned int) '0');
+                }
+              else if (!WHITE(c))
+                {
+                  ep->state = GETTING_NAME;
+
+                  /* initialize argument information */
+                  next_ep->n_arg = 1;
+                  NEW_STRING(1 - ep->select)
+                  next_ep->arg =
+                    const_cast<const char **>(CURR_PTR(1 - ep->select));
+
+                  ADD_CHAR(1 - ep->select,c)
+                  name_hash = sym_hash_char(SYM_HASH_INIT,c);
+                }
+
+              break;
+
+            case GETTING_ARG_NO:
+              if (DIGIT(c))
+                {
+                  arg_no *= 10;
+                  arg_no += ((unsigned int) c) - ((unsigned int) '0');
+
+                  if (arg_no > (INT_MAX / 10))
+                    return("ridiculous macro argument number");
+                }
+              else
+                {
+                  const char *p;
+
+                  if (int(arg_no) < ep->n_arg)
+                    {
+                      /* copy value of argument into result */
+                      p = (ep->arg)[arg_no];
+                      ADD_SPAN(ep->select,p,strlen(p))
+                    }
+
+                  /* if argument number too large, argument considered
+                     to be null */
+
+                  ep->state = WAIT_ARG_END;
+                  continue;
+                }
+              break;
+
+            case WAIT_ARG_END:
+              if (c == RIGHT_DELIM)
+                /* argument invocation has ended */
+                ep->state = NORMAL;
+              else if (!WHITE(c))
+                return("unexpected garbage in macro argument reference");
+
+              break;
+
+            case GETTING_NAME:
+              if ((!WHITE(c)) && (c != RIGHT_DELIM))
+                {
+                  ADD_CHAR(1 - ep->select,c)
+                  name_hash = sym_hash_char(name_hash,c);
+                }
+              else
+                /* good termination of name, get definition */
+                {
+                  next_ep->name_len = size_t(eval[1 - ep->select].buf_free
+                                             - *CURR_PTR(1 - ep->select));
+                  next_ep->name_hash = name_hash;
+
+                  /* null terminate name */
+                  ADD_CHAR(1 - ep->select,(char) '\0')
+
+#if defined(DEBUG)
+
+                  (void) fprintf(stderr,"\nMACRO %s SEEN\n",
+                                 *CURR_PTR(1 - ep->select));
+
+#endif
+
+                  ep->state = WAIT_ARG_OR_MACRO_END;
+                  continue;
+                }
+
+              break;
+
+            case WAIT_ARG_OR_MACRO_END:
+              if (c == EVAL_ARG_DELIM)
+                {
+                  es_rec *tmp_ep;
+
+                  if (nest >= MAX_NEST)
+                    return("macro nesting level too deep");
+
+                  next_ep->n_arg++;
+                  NEW_STRING(1 - ep->select)
+
+                  /* record two above current one is for evaluation
+                     of macro argument.  now evaluating the argument,
+                     make its evaluation stack record current */
+                  set_nest(nest + 2);
+                  tmp_ep = ep - 2;
+
+                  /* fill in record for argument evaluation */
+                  ep->state = NORMAL;
+                  ep->select = 1 - tmp_ep->select;
+                  ep->n_arg = tmp_ep->n_arg;
+                  ep->arg = tmp_ep->arg;
+                  ep->arg_eval = 1;
+
+#if defined(DEBUG)
+
+                  (void) fprintf(stderr,"\nEVAL MACRO ARG\n");
+                  print_es_rec();
+
+#endif
+                }
+              else if (c == RIGHT_DELIM)
+                /* macro invocation completed; time to evaluate it */
+                return(invoke());
+              else if (c == BEGIN1_QUOTE_ARG)
+                ep->state = BEGIN1_QUOTE_ARG_SEEN;
+              else if (!WHITE(c))
+                return("unexpected garbage in macro invocation");
+
+              break;
+
+            case BEGIN1_QUOTE_ARG_SEEN:
+              if (c == BEGIN2_QUOTE_ARG)
+                {
+                  next_ep->n_arg++;
+                  NEW_STRING(1 - ep->select)
+
+                  depth_quote_arg_nest = 1;
+
+                  ep->state = GETTING_QUOTED_ARG;
+                }
+              else
+                return("unexpected garbage in macro invocation");
+
+              break;
+
+            case GETTING_QUOTED_ARG:
+              if (c == END1_QUOTE_ARG)
+                ep->state = END1_QUOTE_ARG_SEEN;
+              else
+                {
+                  if (c == BEGIN1_QUOTE_ARG)
+                    ep->state = BEGIN1_SEEN_WITHIN_ARG;
+
+                  ADD_CHAR(1 - ep->select,c)
+                }
+
+              break;
+
+            case BEGIN1_SEEN_WITHIN_ARG:
+              ADD_CHAR(1 - ep->select,c)
+              if (c == BEGIN2_QUOTE_ARG)
+                depth_quote_arg_nest++;
+              if (c != BEGIN1_QUOTE_ARG)
+                ep->state = GETTING_QUOTED_ARG;
+
+              break;
+
+            case END1_QUOTE_ARG_SEEN:
+              if (c == END2_QUOTE_ARG)
+                {
+                  if (depth_quote_arg_nest == 1)
+                    /* argument has been terminated */
+                    {
+                      /* terminate argument string */
+                      ADD_CHAR(1 - ep->select,(char) '\0')
+
+                      ep->state = WAIT_ARG_OR_MACRO_END;
+                    }
+                  else
+                    {
+                      ADD_CHAR(1 - ep->select,END1_QUOTE_ARG)
+                      ADD_CHAR(1 - ep->select,END2_QUOTE_ARG)
+                      depth_quote_arg_nest--;
+                      ep->state = GETTING_QUOTED_ARG;
+                    }
+                }
+              else
+                /* false alarm */
+                {
+                  ADD_CHAR(1 - ep->select,END1_QUOTE_ARG)
+                  ADD_CHAR(1 - ep->select,c)
+                  if (c != END1_QUOTE_ARG)
+                    ep->state = GETTING_QUOTED_ARG;
+                }
+              break;
+          } /* switch */
+
+        return(SUCCESS);
+      }
+  }
+
+
+/*
+  called when the source on the top of the source stack is exhausted.
+  pops it, and finishes the macro invocation it was part of.
+*/
+const char *Mcr_context::end_source(void)
+  {
+    src_rec s = src_stack.back();
+
+
+    src_stack.pop_back();
+
+    if (s.body != (Mcr_body *) 0)
+      release_body(s.body);
+
+    /* the evaluation of the source may have ended in the midst of
+       something (like an argument evaluation) at a higher level */
+    set_nest(s.level);
+
+    if (s.kind == SRC_BODY)
+      {
+        CLEAR(1 - ep->select,ep->n_arg)
+        set_nest(nest - 1);
+
+        ep->state = NORMAL;
+        invoked = 1;
+
+        return(SUCCESS);
+      }
+
+    /* SRC_BUILT_IN */
+
+    if (s.cont == (Mcr_continuation) 0)
+      return(end_built_in(s.level));
+
+    return(call_built_in(s.level,(Mcr_built_in_func) 0,s.cont,s.count));
+  }
+
+
+/*
+  perform an operation of a compiled macro body.
+*/
+const char *Mcr_context::exec_op
+  (
+    const Mcr_op *o,
+    /* text of program */
+    const char *text
+  )
+  {
+    const char *p;
+    es_rec *tmp_ep;
+
+
+    p = text + o->offset;
+
+    switch (o->code)
+      {
+        case OP_LIT:
+          ADD_SPAN(ep->select,p,o->len)
+          break;
+
+        case OP_ARG:
+          if (int(o->n) < ep->n_arg)
+            {
+              p = (ep->arg)[o->n];
+              ADD_SPAN(ep->select,p,strlen(p))
+            }
+          break;
+
+        case OP_NAME:
+          next_ep->n_arg = 1;
+          NEW_STRING(1 - ep->select)
+          next_ep->arg = const_cast<const char **>(CURR_PTR(1 - ep->select));
+          next_ep->name_len = o->len;
+          next_ep->name_hash = o->n;
+          ADD_SPAN(1 - ep->select,p,o->len)
+          ADD_CHAR(1 - ep->select,(char) '\0')
+          break;
+
+        case OP_QUOTED:
+          next_ep->n_arg++;
+          NEW_STRING(1 - ep->select)
+          ADD_SPAN(1 - ep->select,p,o->len)
+          ADD_CHAR(1 - ep->select,(char) '\0')
+          break;
+
+        case OP_EVAL_ARG:
+          if (nest >= MAX_NEST)
+            return("macro nesting level too deep");
+
+          next_ep->n_arg++;
+          NEW_STRING(1 - ep->select)
+
+          set_nest(nest + 2);
+          tmp_ep = ep - 2;
+
+          ep->state = NORMAL;
+          ep->select = 1 - tmp_ep->select;
+          ep->n_arg = tmp_ep->n_arg;
+          ep->arg = tmp_ep->arg;
+          ep->arg_eval = 1;
+          break;
+
+        case OP_END_ARG:
+          ADD_CHAR(ep->select,(char) '\0')
+          set_nest(nest - 2);
+          break;
+
+        case OP_INVOKE:
+          return(invoke());
+      }
+
+    return(SUCCESS);
+  }
+
+
+/*
+  evaluate the sources on the source stack, until the one at index
+  base is exhausted, or a macro invocation is completed while it is
+  on top.
+*/
+const char *Mcr_context::run
+  (
+    size_t base
+  )
+  {
+    const char *p,*q,*rv;
+    src_rec *sp;
+
+
+    invoked = 0;
+    for ( ; ; )
+      {
+        /* when pulling, pause once the chunk wanted is ready */
+        if ((pull_chunk != 0) &&
+            (size_t(result - &pull_str[0]) >= pull_chunk))
+          return(SUCCESS);
+
+        sp = &src_stack.back();
+
+        if (src_stack.size() == (base + 1))
+          {
+            if (invoked || (sp->p == sp->end))
+              return(SUCCESS);
+          }
+        else if (sp->op != sp->op_end)
+          {
+            /* perform an operation of a compiled body.  this may push
+               new sources */
+            rv = exec_op(sp->op++,sp->op_text);
+            if (rv != SUCCESS)
+              return(rv);
+
+            continue;
+          }
+        else if (sp->p == sp->end)
+          {
+            rv = end_source();
+            if (rv != SUCCESS)
+              return(rv);
+
+            continue;
+          }
+
+        p = sp->p;
+        if (ep->state == NORMAL)
+          /* copy run of characters with no special meaning in bulk */
+          {
+            q = scan_delim(p,sp->end,LEAD,
+                           ep->arg_eval ? EVAL_ARG_DELIM : LEAD);
+
+
+            if (q != p)
+              {
+                sp->p = q;
+                ADD_SPAN(ep->select,p,size_t(q - p))
+
+                continue;
+              }
+          }
+        else if (ep->state == GETTING_QUOTED_ARG)
+          /* copy run of characters that cannot start or end a nested
+             quoted argument in bulk */
+          {
+            q = scan_delim(p,sp->end,END1_QUOTE_ARG,BEGIN1_QUOTE_ARG);
+            if (q != p)
+              {
+                sp->p = q;
+                ADD_SPAN(1 - ep->select,p,size_t(q - p))
+
+                continue;
+              }
+          }
+
+        /* evaluate one character.  this may push new sources */
+        sp->p = p + 1;
+        rv = eval_char(*p);
+        if (rv != SUCCESS)
+          return(rv);
+      }
+  }
+
+
+/*
+  next span of characters to evaluate.
+*/
+const char *Mcr_context::next_chars
+  (
+    /* characters to evaluate */
+    const char *s,
+    /* number of characters in span */
+    size_t n,
+    /* if not null, set to the number of characters consumed */
+    size_t *n_used
+  )
+  {
+    size_t base = src_stack.size();
+    src_rec in;
+    const char *rv;
+
+
+    in.kind = SRC_INPUT;
+    in.p = s;
+    in.end = s + n;
+    in.op = in.op_end = (const Mcr_op *) 0;
+    in.body = (Mcr_body *) 0;
+    in.folded = false;
+    in.level = nest;
+    src_stack.push_back(in);
+
+    rv = run(base);
+
+    /* flush the sink if a line has been completed and it wants lines */
+    if (sink_line)
+      {
+        if ((rv == SUCCESS) &&
+            (memchr(line_start,'\n',size_t(result - line_start)) !=
+             (void *) 0))
+          rv = flush_sink();
+        else
+          line_start = result;
+      }
+
+    if (n_used != (size_t *) 0)
+      *n_used = size_t(src_stack[base].p - s);
+
+    /* on error, also discard the sources the input led to */
+    pop_sources(base);
+
+    return(rv);
+  }
+
+
+
+
+/*
+  begin an expansion whose input and result are pulled
+*/
+const char *Mcr_context::start_pull
+  (
+    Mcr_source_func src,
+    void *data,
+    int n_orig_arg,
+    const char **orig_arg
+  )
+  {
+    src_rec in;
+
+
+    start_expand(n_orig_arg,orig_arg);
+
+    pull_src = src;
+    pull_data = data;
+    pull_eof = false;
+
+    /* the bottom source holds the span of input being evaluated.  it
+       stays on the stack while the expansion is paused */
+    in.kind = SRC_INPUT;
+    in.p = in.end = (const char *) 0;
+    in.op = in.op_end = (const Mcr_op *) 0;
+    in.body = (Mcr_body *) 0;
+    in.folded = false;
+    in.level = nest;
+    src_stack.push_back(in);
+
+    return(set_sink(&pull_str,(Mcr_sink_func) 0,(void *) 0,false));
+  }
+
+
+/*
+  continue a pulled expansion until a chunk of the result is ready
+*/
+const char *Mcr_context::pull
+  (
+    size_t want,
+    const char **text,
+    size_t *len
+  )
+  {
+    const char *rv = SUCCESS,*s;
+    size_t n;
+
+
+    /* the caller is done with the previous chunk */
+    if (sink_str != &pull_str)
+      (void) set_sink(&pull_str,(Mcr_sink_func) 0,(void *) 0,false);
+    pull_str.clear();
+    result = &pull_str[0];
+    n_result = 0;
+
+    pull_chunk = (want != 0) ? want : 1;
+    while ((size_t(result - &pull_str[0]) < pull_chunk) &&
+           !src_stack.empty())
+      {
+        if ((src_stack.size() == 1) && (src_stack[0].p == src_stack[0].end))
+          {
+            /* the span of input has been evaluated, get another */
+            if (pull_eof)
+              break;
+
+            rv = pull_src(pull_data,&s,&n);
+            if (rv != SUCCESS)
+              break;
+
+            if (n == 0)
+              pull_eof = true;
+            else
+              {
+                src_stack[0].p = s;
+                src_stack[0].end = s + n;
+              }
+
+            continue;
+          }
+
+        rv = run(0);
+        if (rv != SUCCESS)
+          break;
+      }
+    pull_chunk = 0;
+
+    if (rv != SUCCESS)
+      {
+        /* the expansion cannot be continued */
+        pop_sources(0);
+        pull_eof = true;
+      }
+
+    (void) flush_sink();
+    *text = pull_str.data();
+    *len = pull_str.size();
+
+    return(rv);
+  }
+
+
+
+
+/* functions of interface to package */
+
+/*
+  create a context for expansion
+*/
+Mcr_context *mcr_new_context(void)
+  {
+    return(new Mcr_context((const Mcr_context *) 0));
+  }
+
+
+/*
+  create a context for expansion, based on a frozen context
+*/
+Mcr_context *mcr_new_derived_context
+  (
+    /* context whose definitions are used */
+    const Mcr_context *base
+  )
+  {
+    return(new Mcr_context(base));
+  }
+
+
+/*
+  freeze the definitions of a context
+*/
+void mcr_freeze
+  (
+    Mcr_context *ctx
+  )
+  {
+    if (!ctx->frozen)
+      {
+        /* the definitions no longer change, so small macros can be
+           inlined into the bodies that invoke them */
+        Mcr_inline_state state;
+
+        ctx->sym_tab.for_each(
+          [ctx, &state](const SYM_TAB::Entry &e)
+            {
+              Mcr_body *b = e.value.has_string() ? e.value.body() : nullptr;
+
+              if (b != (Mcr_body *) 0)
+                ctx->fold(b, &state);
+            });
+
+        ctx->frozen = true;
+        ctx->sym_tab.for_each(
+          [](const SYM_TAB::Entry &e) { e.value.share(true); });
+      }
+  }
+
+
+/*
+  destroy a context
+*/
+void mcr_delete_context
+  (
+    Mcr_context *ctx
+  )
+  {
+    delete ctx;
+  }
+
+
+/*
+  sink function for a file sink.  the data is the context
+*/
+static const char *fd_sink
+  (
+    void *data,
+    const char *text,
+    size_t len
+  )
+  {
+    int fd = static_cast<Mcr_context *>(data)->sink_fd;
+    ssize_t n;
+
+
+    while (len != 0)
+      {
+        n = write(fd,text,len);
+        if (n < 0)
+          {
+            if (errno == EINTR)
+              continue;
+
+            return("error writing to output");
+          }
+        text += n;
+        len -= size_t(n);
+      }
+
+    return(SUCCESS);
+  }
+
+
+/*
+  make the final result of expansion be appended to a string
+*/
+const char *mcr_sink_string
+  (
+    Mcr_context *ctx,
+    /* string to append to */
+    std::string *str
+  )
+  {
+    return(ctx->set_sink(str,(Mcr_sink_func) 0,(void *) 0,false));
+  }
+
+
+/*
+  make the final result of expansion be written to a file
+*/
+const char *mcr_sink_fd
+  (
+    Mcr_context *ctx,
+    /* file descriptor to write to */
+    int fd,
+    /* if non-zero, the result is written when a line is completed */
+    int line
+  )
+  {
+    const char *rv = ctx->set_sink((std::string *) 0,fd_sink,ctx,line != 0);
+
+
+    /* set after the previous sink, which may also be a file, has been
+       flushed */
+    ctx->sink_fd = fd;
+
+    return(rv);
+  }
+
+
+/*
+  make the final result of expansion be given to a function
+*/
+const char *mcr_sink_func
+  (
+    Mcr_context *ctx,
+    /* function to call with result, null to discard it */
+    Mcr_sink_func func,
+    /* data to pass to func */
+    void *data
+  )
+  {
+    return(ctx->set_sink((std::string *) 0,func,data,false));
+  }
+
+
+/*
+  give the final result of expansion so far to the sink
+*/
+const char *mcr_flush_sink
+  (
+    Mcr_context *ctx
+  )
+  {
+    return(ctx->flush_sink());
+  }
+
+
+/*
+  function to begin expansion
+*/
+void mcr_start_expand
+  (
+    Mcr_context *ctx,
+    /* number of top level arguments */
+    int n_orig_arg,
+    /* array of top level arguments */
+    const char **orig_arg
+  )
+  {
+    ctx->start_expand(n_orig_arg,orig_arg);
+  }
+
+
+/*
+  insert a character directly into the output
+  stream without evaluating it
+*/
+const char *mcr_noeval_char
+  (
+    Mcr_context *ctx,
+    char c
+  )
+  {
+    return(ctx->noeval_char(c));
+  }
+
+
+/*
+  insert a span of characters directly into the output stream without
+  evaluating them
+*/
+const char *mcr_noeval_span
+  (
+    Mcr_context *ctx,
+    const char *text,
+    size_t len
+  )
+  {
+    return(ctx->noeval_span(text,len));
+  }
+
+
+/*
+  schedule text to be expanded in place of the invocation of a
+  built-in macro.
+*/
+const char *mcr_expand_text
+  (
+    Mcr_context *ctx,
+    /* text to expand */
+    const char *text,
+    /* function to call when text has been expanded, may be null */
+    Mcr_continuation cont,
+    /* counter to pass to cont */
+    long int count
+  )
+  {
+    return(ctx->expand_text(text,cont,count));
+  }
+
+
+/*
+  begin an expansion whose input is pulled from a function, and whose
+  result is pulled by the caller
+*/
+const char *mcr_start_pull
+  (
+    Mcr_context *ctx,
+    /* function to get input from */
+    Mcr_source_func src,
+    /* data to pass to src */
+    void *data,
+    /* number of top level arguments */
+    int n_orig_arg,
+    /* array of top level arguments */
+    const char **orig_arg
+  )
+  {
+    return(ctx->start_pull(src,data,n_orig_arg,orig_arg));
+  }
+
+
+/*
+  get the next chunk of the result of a pulled expansion
+*/
+const char *mcr_pull
+  (
+    Mcr_context *ctx,
+    /* length of chunk wanted */
+    size_t want,
+    /* variable to put pointer to chunk into */
+    const char **text,
+    /* variable to put length of chunk into */
+    size_t *len
+  )
+  {
+    return(ctx->pull(want,text,len));
+  }
+
+
+/*
+  next character to evaluate.
+*/
+const char *mcr_next_char
+  (
+    Mcr_context *ctx,
+    char c
+  )
+  {
+    return(ctx->next_chars(&c,1,(size_t *) 0));
+  }
+
+
+/*
+  next span of characters to evaluate.
+*/
+const char *mcr_next_chars
+  (
+    Mcr_context *ctx,
+    /* characters to evaluate */
+    const char *s,
+    /* number of characters in span */
+    size_t n,
+    /* if not null, set to the number of characters consumed */
+    size_t *n_used
+  )
+  {
+    return(ctx->next_chars(s,n,n_used));
+  }
+
+
+/*
+  boolean function - returns non-zero if in midst of
+  a macro expansion.
+*/
+int mcr_expanding
+  (
+    Mcr_context *ctx
+  )
+  {
+    return(ctx->eval_stack[0].state != NORMAL);
+  }
+
+
+/*
+  get the number of macro invocations done by a context
+*/
+unsigned long int mcr_n_invoked
+  (
+    Mcr_context *ctx
+  )
+  {
+    return(ctx->n_invoked);
+  }
+
+
+/*
+  get the number of texts scheduled by built-in macros in a context,
+  and the number of them run from compiled forms in its cache
+*/
+unsigned long int mcr_n_scheduled
+  (
+    Mcr_context *ctx,
+    unsigned long int *n_cached
+  )
+  {
+    *n_cached = ctx->n_cached;
+
+    return(ctx->n_sched);
+  }
+
+
+/*
+  set or clear the flag that ends the innermost loop
+*/
+void mcr_set_break
+  (
+    Mcr_context *ctx,
+    int flag
+  )
+  {
+    ctx->break_flag = flag;
+  }
+
+
+/*
+  get the flag that ends the innermost loop
+*/
+int mcr_get_break
+  (
+    Mcr_context *ctx
+  )
+  {
+    return(ctx->break_flag);
+  }
+
+
+/*
+  set pointer to data of the caller
+*/
+void mcr_set_user_data
+  (
+    Mcr_context *ctx,
+    void *data
+  )
+  {
+    ctx->user_data = data;
+  }
+
+
+/*
+  get pointer to data of the caller
+*/
+void *mcr_user_data
+  (
+    Mcr_context *ctx
+  )
   {
-    return(eval_stack[0].state != NORMAL);
+    return(ctx->user_data);
   }
@@ -20,41 +20,156 @@ SOFTWARE.
 /*
   include file for macro package.  functions return
   pointer to message for error, null pointer for success.
+  all the state of an expansion, including the macro definitions,
+  is in a context.  different contexts can be used concurrently by
+  different threads.
 */
 
 #if !defined(H_MACRO)
 #define H_MACRO
 
-#if defined(MCR_FILE)
-/* in implementation file for package */
+#include <stddef.h>
+#include <string>
 
-/* final result for caller */
-char *mcr_result;
-/* free spaces in final result area */
-int mcr_n_result;
+/* context for expansion */
+struct Mcr_context;
 
-#else
+using Mcr_built_in_func =
+  const char *(*)(Mcr_context *ctx,int n_arg,const char **arg);
 
-/* define for caller */
-extern char *mcr_result;
-extern int mcr_n_result;
+/* function called when text scheduled by mcr_expand_text() has been
+   expanded.  it is passed the arguments of the built-in macro that
+   scheduled the text, and the count given when scheduling it.  like
+   a built-in function, it can schedule text to expand, and must return
+   null for success, an error message string for failure. */
+using Mcr_continuation =
+  const char *(*)(Mcr_context *ctx,int n_arg,const char **arg,
+                  long int count);
 
-#endif
 
-using Mcr_built_in_func = const char *(*)(int n_arg,const char **arg);
+/*
+  create a context for expansion, with no macros defined
+*/
+Mcr_context *mcr_new_context(void);
+
+
+/*
+  create a context for expansion whose macros are initially those
+  of a frozen context.  definitions made in the new context do not
+  affect the base.  any number of contexts, used by different threads,
+  can share a base, which must not be destroyed before them.
+*/
+Mcr_context *mcr_new_derived_context
+  (
+    /* context whose definitions are used */
+    const Mcr_context *base
+  );
+
+
+/*
+  freeze the definitions of a context, so that it can be the base of
+  other contexts.  after this, attempts to define macros in it fail.
+  must not be called while the context is expanding.  invocations of
+  small macros, whose bodies are literal text and argument references,
+  are then inlined into the bodies which invoke them.  such a macro is
+  marked constant (see mcr_set_constant()), so if a derived context
+  changes its definition, the bodies are evaluated as defined there.
+*/
+void mcr_freeze
+  (
+    Mcr_context *ctx
+  );
+
+
+/*
+  destroy a context
+*/
+void mcr_delete_context
+  (
+    Mcr_context *ctx
+  );
+
+
+/*
+  the final result of expansion goes to a sink, which is a string, a
+  file or a function.  characters accumulate in an area, and are given
+  to the sink when the area is full (large spans of characters are
+  given to it directly), or when the sink is flushed, so there is no
+  limit on the size of the result.  until a sink is given, the result
+  is discarded.  the functions which set the sink flush the previous
+  one, returning any error from doing so.  a sink should be flushed
+  before the context is destroyed.
+*/
+
+/* function called with characters of the final result of expansion.
+   it must return null for success, an error message string for
+   failure (the expansion fails). */
+using Mcr_sink_func =
+  const char *(*)(void *data,const char *text,size_t len);
+
+
+/*
+  make the final result of expansion be appended to a string.  the
+  result goes directly into the string, but it can have extra
+  characters at its end until the sink is flushed.
+*/
+const char *mcr_sink_string
+  (
+    Mcr_context *ctx,
+    /* string to append to */
+    std::string *str
+  );
+
+
+/*
+  make the final result of expansion be written to a file
+*/
+const char *mcr_sink_fd
+  (
+    Mcr_context *ctx,
+    /* file descriptor to write to */
+    int fd,
+    /* if non-zero, the result is written when a line is completed,
+       otherwise when a large amount of it has accumulated */
+    int line
+  );
+
+
+/*
+  make the final result of expansion be given to a function
+*/
+const char *mcr_sink_func
+  (
+    Mcr_context *ctx,
+    /* function to call with result, null to discard it */
+    Mcr_sink_func func,
+    /* data to pass to func */
+    void *data
+  );
+
+
+/*
+  give the final result of expansion so far to the sink
+*/
+const char *mcr_flush_sink
+  (
+    Mcr_context *ctx
+  );
+
 
 /*
   define a macro
 */
 const char *mcr_def
   (
+    Mcr_context *ctx,
     /* name of macro */
     const char *name,
     /* body of definition (cannot be altered after call) */
     void *mval,
     /* if magic != 0, the body of the macro is a string.  if magic
        = 0, body is a pointer for a function whose proto-type is
-       const char *f(int n_arg,const char **arg);
+       const char *f(Mcr_context *ctx,int n_arg,const char **arg);
        this function is called when the macro is invoked, with
        the number of arguments to the macro and the
        array of arguments.  The first argument is the name
@@ -64,10 +179,115 @@ const char *mcr_def
   );
 
 
+/*
+  define a pure built-in macro.  its result must only depend on its
+  arguments, and it must have no other effect, and not use the user
+  data of the context.  it is constant (see mcr_set_constant()), so
+  invocations of it can be folded, which calls the function in another
+  context.  a macro defined by mcr_def() with a function cannot be made
+  constant.
+*/
+const char *mcr_def_pure
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name,
+    /* function called when the macro is invoked, as for mcr_def() */
+    void *func
+  );
+
+
+/*
+  define a macro to have the same definition as another macro.  the
+  body of a string macro is shared rather than copied.  if the other
+  macro is not defined, the macro is deleted.
+*/
+const char *mcr_copy_def
+  (
+    Mcr_context *ctx,
+    /* name of macro to define */
+    const char *name,
+    /* name of macro whose definition is copied */
+    const char *from
+  );
+
+
+/*
+  define a macro whose body is the decimal text of a number.  the
+  number is stored as such, the text is only formed when the macro is
+  invoked.
+*/
+const char *mcr_def_num
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name,
+    /* value of number */
+    long int num
+  );
+
+
+/*
+  mark a macro as constant.  this promises that its expansion depends
+  only on its arguments, and has no other effect.  a built-in macro
+  can only be constant if it was defined by mcr_def_pure(), or is a
+  copy of one.  in bodies defined after this, invocations of it whose
+  arguments are literal text are replaced by their results, once, when
+  the body is defined, unless a result is longer than a few thousand
+  characters.  if the definition of the macro is changed, it is no
+  longer constant, and bodies that were folded using it are evaluated
+  as they were defined.
+*/
+const char *mcr_set_constant
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name
+  );
+
+
+/*
+  get the value of a macro defined by mcr_def_num().  returns non-zero
+  if the macro is defined as a number, zero otherwise.
+*/
+int mcr_num_value
+  (
+    Mcr_context *ctx,
+    /* name of macro */
+    const char *name,
+    /* set to value of number */
+    long int *num
+  );
+
+
+/*
+  get the value of a macro for a name in a numeric expression.  a
+  macro defined by mcr_def_num() gives its number, a string macro
+  gives the number its body is the decimal text of (with optional
+  sign and surrounding white space).  returns non-zero if the macro
+  gives a number, zero otherwise.  while an invocation of a constant
+  built-in macro is being folded (see mcr_set_constant()), it returns
+  zero for every name, so the built-in fails and is not folded.
+*/
+int mcr_name_value
+  (
+    Mcr_context *ctx,
+    /* name of macro, not null terminated */
+    const char *name,
+    /* number of characters in name */
+    size_t len,
+    /* set to value of number */
+    long int *num
+  );
+
+
 /*
   dump names in macro table
 */
-void mcr_dump(void);
+void mcr_dump
+  (
+    Mcr_context *ctx
+  );
 
 
 /*
@@ -75,6 +295,7 @@ void mcr_dump(void);
 */
 void mcr_start_expand
   (
+    Mcr_context *ctx,
     /* number of top level arguments */
     int n_orig_arg,
     /* array of top level arguments */
@@ -88,23 +309,202 @@ void mcr_start_expand
 */
 const char *mcr_noeval_char
   (
+    Mcr_context *ctx,
     char c
   );
 
 
+/*
+  insert a span of characters directly into the output stream without
+  evaluating them.  space for them is made once, and they are copied
+  in bulk.
+*/
+const char *mcr_noeval_span
+  (
+    Mcr_context *ctx,
+    /* characters to insert */
+    const char *text,
+    /* number of characters */
+    size_t len
+  );
+
+
+/*
+  schedule text to be expanded in place of the invocation of a
+  built-in macro.  can only be called once by a built-in function
+  or continuation, the expansion happens after it returns.  the text
+  must remain unchanged until then (arguments of the built-in macro
+  do).
+*/
+const char *mcr_expand_text
+  (
+    Mcr_context *ctx,
+    /* text to expand */
+    const char *text,
+    /* function to call when text has been expanded, may be null */
+    Mcr_continuation cont,
+    /* count to pass to cont */
+    long int count
+  );
+
+
+/*
+  an expansion can also be driven by its consumer.  input is pulled
+  from a function when it is needed, and the expansion pauses when a
+  chunk of the result is ready, until the caller pulls the next one.
+  so the result accumulates no further than the caller takes it (a
+  single built-in macro can still produce more than the chunk wanted).
+*/
+
+/* function called to get the next span of input for a pulled
+   expansion.  the span must remain unchanged until the function is
+   called again.  a span of length 0 ends the input.  it must return
+   null for success, an error message string for failure. */
+using Mcr_source_func =
+  const char *(*)(void *data,const char **text,size_t *len);
+
+
+/*
+  begin an expansion whose input is pulled from a function.  the
+  result goes to a sink of the context until it is pulled, so the
+  previous sink is flushed, and any error doing so is returned.
+*/
+const char *mcr_start_pull
+  (
+    Mcr_context *ctx,
+    /* function to get input from */
+    Mcr_source_func src,
+    /* data to pass to src */
+    void *data,
+    /* number of top level arguments */
+    int n_orig_arg,
+    /* array of top level arguments */
+    const char **orig_arg
+  );
+
+
+/*
+  get the next chunk of the result of a pulled expansion.  the chunk
+  remains valid until the next call.  it is shorter than wanted only at
+  the end of the input, and is empty after the end.  afterwards,
+  mcr_expanding() tells if the input ended in the middle of a macro
+  invocation.  after an error, the chunk has the result produced before
+  it, and the expansion cannot be continued.
+*/
+const char *mcr_pull
+  (
+    Mcr_context *ctx,
+    /* length of chunk wanted */
+    size_t want,
+    /* variable to put pointer to chunk into */
+    const char **text,
+    /* variable to put length of chunk into */
+    size_t *len
+  );
+
+
 /*
   next character to evaluate.
 */
 const char *mcr_next_char
   (
+    Mcr_context *ctx,
     char c
   );
 
 
+/*
+  next span of characters to evaluate.  runs of characters that
+  are simply copied to the output are handled in bulk, so large
+  spans can be given.  evaluation stops early after a character which
+  completes a macro invocation, so no further input is consumed before
+  the caller sees it (the invoked macro may have switched the input,
+  for example).
+*/
+const char *mcr_next_chars
+  (
+    Mcr_context *ctx,
+    /* characters to evaluate */
+    const char *s,
+    /* number of characters in span */
+    size_t n,
+    /* if not null, set to the number of characters consumed
+       (including the character that caused an error) */
+    size_t *n_used
+  );
+
+
 /*
   boolean function - returns non-zero if in midst of
   a macro expansion.
 */
-int mcr_expanding(void);
+int mcr_expanding
+  (
+    Mcr_context *ctx
+  );
+
+
+/*
+  get the number of macro invocations done by a context, for measuring
+  the cost of expansion
+*/
+unsigned long int mcr_n_invoked
+  (
+    Mcr_context *ctx
+  );
+
+
+/*
+  get the number of texts scheduled for expansion by built-in macros
+  (such as the clauses of if and loop) in a context, for measuring the
+  cache of their compiled forms.  a text is compiled the second time it
+  is scheduled, and run from its compiled form after that.
+*/
+unsigned long int mcr_n_scheduled
+  (
+    Mcr_context *ctx,
+    /* set to the number of the texts run from compiled forms */
+    unsigned long int *n_cached
+  );
+
+
+/*
+  set or clear the flag that ends the innermost loop.  the flag is
+  cleared when expansion begins.
+*/
+void mcr_set_break
+  (
+    Mcr_context *ctx,
+    int flag
+  );
+
+
+/*
+  get the flag that ends the innermost loop
+*/
+int mcr_get_break
+  (
+    Mcr_context *ctx
+  );
+
+
+/*
+  set pointer to data of the caller, which built-in macros defined
+  by the caller can use.  it is null when the context is created.
+*/
+void mcr_set_user_data
+  (
+    Mcr_context *ctx,
+    void *data
+  );
+
+
+/*
+  get pointer to data of the caller
+*/
+void *mcr_user_data
+  (
+    Mcr_context *ctx
+  );
 
 #endif
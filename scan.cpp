@@ -0,0 +1,354 @@
+/*
+Copyright (c) 2016 Walter William Karas
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+  functions to scan text quickly for characters of special
+  significance.
+*/
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+
+/*
+  scan one character at a time
+*/
+static const char *scan_scalar
+  (
+    const char *p,
+    const char *end,
+    char c1,
+    char c2
+  )
+  {
+    while ((p != end) && (*p != c1) && (*p != c2) && (*p != (char) '\0'))
+      p++;
+
+    return(p);
+  }
+
+/*
+  count one character at a time
+*/
+static size_t count_scalar
+  (
+    const char *p,
+    const char *end,
+    char c
+  )
+  {
+    size_t n = 0;
+
+
+    for ( ; p != end; p++)
+      n += (*p == c);
+
+    return(n);
+  }
+
+#if defined(__SSE2__)
+
+/*
+  scan 16 characters at a time
+*/
+static const char *scan_sse2
+  (
+    const char *p,
+    const char *end,
+    char c1,
+    char c2
+  )
+  {
+    const __m128i v1 = _mm_set1_epi8(c1);
+    const __m128i v2 = _mm_set1_epi8(c2);
+    const __m128i v0 = _mm_setzero_si128();
+
+    __m128i v;
+    int mask;
+
+
+    while ((end - p) >= 16)
+      {
+        v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        mask = _mm_movemask_epi8(
+                 _mm_or_si128(
+                   _mm_or_si128(_mm_cmpeq_epi8(v,v1),_mm_cmpeq_epi8(v,v2)),
+                   _mm_cmpeq_epi8(v,v0)));
+        if (mask != 0)
+          return(p + __builtin_ctz(unsigned(mask)));
+
+        p += 16;
+      }
+
+    return(scan_scalar(p,end,c1,c2));
+  }
+
+
+/*
+  count 16 characters at a time.  the matches in each position are
+  counted in a byte, and the bytes are summed before they can overflow
+*/
+static size_t count_sse2
+  (
+    const char *p,
+    const char *end,
+    char c
+  )
+  {
+    const __m128i vc = _mm_set1_epi8(c);
+    const __m128i v0 = _mm_setzero_si128();
+
+    __m128i acc,sum;
+    size_t n = 0,n_block;
+
+
+    while ((end - p) >= 16)
+      {
+        n_block = size_t(end - p) / 16;
+        if (n_block > 255)
+          n_block = 255;
+
+        acc = v0;
+        for ( ; n_block != 0; n_block--, p += 16)
+          acc = _mm_sub_epi8(acc,_mm_cmpeq_epi8(
+                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)),vc));
+
+        sum = _mm_sad_epu8(acc,v0);
+        n += size_t(_mm_cvtsi128_si32(sum)) + size_t(_mm_extract_epi16(sum,4));
+      }
+
+    return(n + count_scalar(p,end,c));
+  }
+
+
+/*
+  scan 32 characters at a time
+*/
+__attribute__((target("avx2")))
+static const char *scan_avx2
+  (
+    const char *p,
+    const char *end,
+    char c1,
+    char c2
+  )
+  {
+    const __m256i v1 = _mm256_set1_epi8(c1);
+    const __m256i v2 = _mm256_set1_epi8(c2);
+    const __m256i v0 = _mm256_setzero_si256();
+
+    __m256i v;
+    unsigned mask;
+
+
+    while ((end - p) >= 32)
+      {
+        v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        mask = unsigned(_mm256_movemask_epi8(
+                 _mm256_or_si256(
+                   _mm256_or_si256(_mm256_cmpeq_epi8(v,v1),
+                                   _mm256_cmpeq_epi8(v,v2)),
+                   _mm256_cmpeq_epi8(v,v0))));
+        if (mask != 0)
+          return(p + __builtin_ctz(mask));
+
+        p += 32;
+      }
+
+    /* the remainder is handled here rather than by scan_sse2(), to
+       avoid the penalty for mixing SSE and AVX encoded instructions */
+    if ((end - p) >= 16)
+      {
+        __m128i v16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+
+        mask = unsigned(_mm_movemask_epi8(
+                 _mm_or_si128(
+                   _mm_or_si128(
+                     _mm_cmpeq_epi8(v16,_mm256_castsi256_si128(v1)),
+                     _mm_cmpeq_epi8(v16,_mm256_castsi256_si128(v2))),
+                   _mm_cmpeq_epi8(v16,_mm256_castsi256_si128(v0)))));
+        if (mask != 0)
+          return(p + __builtin_ctz(mask));
+
+        p += 16;
+      }
+
+    while ((p != end) && (*p != c1) && (*p != c2) && (*p != (char) '\0'))
+      p++;
+
+    return(p);
+  }
+
+
+
+/*
+  count 32 characters at a time
+*/
+__attribute__((target("avx2")))
+static size_t count_avx2
+  (
+    const char *p,
+    const char *end,
+    char c
+  )
+  {
+    const __m256i vc = _mm256_set1_epi8(c);
+    const __m256i v0 = _mm256_setzero_si256();
+
+    __m256i acc,sad;
+    __m128i sum;
+    size_t n = 0,n_block;
+
+
+    while ((end - p) >= 32)
+      {
+        n_block = size_t(end - p) / 32;
+        if (n_block > 255)
+          n_block = 255;
+
+        acc = v0;
+        for ( ; n_block != 0; n_block--, p += 32)
+          acc = _mm256_sub_epi8(acc,_mm256_cmpeq_epi8(
+                  _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)),
+                  vc));
+
+        sad = _mm256_sad_epu8(acc,v0);
+        sum = _mm_add_epi64(_mm256_castsi256_si128(sad),
+                            _mm256_extracti128_si256(sad,1));
+        n += size_t(_mm_cvtsi128_si32(sum)) + size_t(_mm_extract_epi16(sum,4));
+      }
+
+    /* the remainder is handled here for the same reason as in
+       scan_avx2() */
+    for ( ; p != end; p++)
+      n += (*p == c);
+
+    return(n);
+  }
+
+#endif
+
+typedef const char *(*Scan_func)(const char *,const char *,char,char);
+
+/* implementation functions, indexed by SCAN_xxx value */
+static const Scan_func scan_func[] =
+  {
+    scan_scalar,
+#if defined(__SSE2__)
+    scan_sse2,
+    scan_avx2
+#endif
+  };
+
+typedef size_t (*Count_func)(const char *,const char *,char);
+
+/* counting functions, indexed by SCAN_xxx value */
+static const Count_func count_func[] =
+  {
+    count_scalar,
+#if defined(__SSE2__)
+    count_sse2,
+    count_avx2
+#endif
+  };
+
+/*
+  returns the best implementation the processor supports
+*/
+static int best_impl(void)
+  {
+#if defined(__SSE2__)
+    /* may be called before the constructor that initializes the
+       processor feature information */
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+      return(SCAN_AVX2);
+    else
+      return(SCAN_SSE2);
+#else
+    return(SCAN_SCALAR);
+#endif
+  }
+
+/* implementation in use */
+static Scan_func scan_impl = scan_func[best_impl()];
+static Count_func count_impl = count_func[best_impl()];
+
+
+/*
+  returns a pointer to the first character in the range [p, end)
+  which is equal to c1, c2 or the null character.
+*/
+const char *scan_delim
+  (
+    /* start of text to scan */
+    const char *p,
+    /* end of text to scan */
+    const char *end,
+    /* characters to look for */
+    char c1,
+    char c2
+  )
+  {
+    return(scan_impl(p,end,c1,c2));
+  }
+
+
+/*
+  returns the number of characters in the range [p, end) which are
+  equal to c.
+*/
+size_t scan_count
+  (
+    /* start of text to scan */
+    const char *p,
+    /* end of text to scan */
+    const char *end,
+    /* character to count */
+    char c
+  )
+  {
+    return(count_impl(p,end,c));
+  }
+
+
+/*
+  select the implementation used by scan_delim and scan_count.
+*/
+int scan_select
+  (
+    /* one of the SCAN_xxx values */
+    int impl
+  )
+  {
+    int best = best_impl();
+
+
+    if ((impl < SCAN_SCALAR) || (impl > best))
+      impl = best;
+
+    scan_impl = scan_func[impl];
+    count_impl = count_func[impl];
+
+    return(impl);
+  }
@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2016 Walter William Karas
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+  include file for functions to scan text quickly for characters of
+  special significance.  vector instructions are used when the
+  processor supports them.
+*/
+
+#if !defined(H_SCAN)
+#define H_SCAN
+
+#include <stddef.h>
+
+/* implementations of the scan, in order of increasing speed */
+
+/* one character at a time */
+#define SCAN_SCALAR 0
+/* 16 characters at a time using SSE2 */
+#define SCAN_SSE2 1
+/* 32 characters at a time using AVX2 */
+#define SCAN_AVX2 2
+
+/*
+  returns a pointer to the first character in the range [p, end)
+  which is equal to c1, c2 or the null character.  returns end if
+  there is no such character.
+*/
+const char *scan_delim
+  (
+    /* start of text to scan */
+    const char *p,
+    /* end of text to scan */
+    const char *end,
+    /* characters to look for */
+    char c1,
+    char c2
+  );
+
+
+/*
+  returns the number of characters in the range [p, end) which are
+  equal to c.
+*/
+size_t scan_count
+  (
+    /* start of text to scan */
+    const char *p,
+    /* end of text to scan */
+    const char *end,
+    /* character to count */
+    char c
+  );
+
+
+/*
+  select the implementation used by scan_delim and scan_count.  the
+  best one the processor supports is selected automatically, this is
+  intended for benchmarking.  returns the implementation actually selected, which
+  can be less than the one requested.
+*/
+int scan_select
+  (
+    /* one of the SCAN_xxx values */
+    int impl
+  );
+
+#endif
@@ -16,59 +16,128 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
-
 /*
   main program for Simple Macro Processor.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 #include "stralloc.h"
 #include "trfile.h"
 #include "macro.h"
 
-/* results buffer */
-#define SIZE_RES_BUF 16*1024
-static char res_buf[SIZE_RES_BUF];
+/* if set, output is written at the end of each line */
+static bool line_flush;
+
+/* maximum number of output files a job keeps open */
+static size_t max_out_files = 16;
 
 /* external function which defines most of the builtins */
-const char *def_builtins(void);
+const char *def_builtins(Mcr_context *ctx);
 
 /* maximum level of include file nesting */
 #define MAX_INCLUDE_NEST 10
 
-/* stack of input file structures */
-static TR_DESC input_desc[MAX_INCLUDE_NEST + 1];
-/* index of current input file structure */
-static int input_desc_idx;
+/* output file kept open by a job */
+struct out_file
+  {
+    /* name it was opened with */
+    std::string name;
+    /* file descriptor */
+    int fd;
+    /* value of the job's count of output file switches when it was
+       last switched to */
+    unsigned long last_use;
+  };
+
+/* state of the expansion of a primary input file.  it is the user
+   data of the context the expansion is done in */
+struct smac_job
+  {
+    /* stack of input file structures */
+    TR_DESC input_desc[MAX_INCLUDE_NEST + 1];
+    /* index of current input file structure */
+    int input_desc_idx;
+    /* file descriptor for output, -1 if output is discarded */
+    int out_fd;
+    /* output files kept open, so switching back to one does not
+       reopen it.  when there are too many, the least recently used is
+       closed */
+    std::vector<out_file> out_files;
+    /* count of switches to output files */
+    unsigned long n_out_switch;
+    /* name of primary input file to put in front of error messages
+       which do not come from the TR functions, null if none */
+    const char *label;
+  };
+
+/*
+  print error message for a (traced) file.  jobs may be running
+  on other threads, so the lines of the message are kept together.
+*/
+static void print_tr_error
+  (
+    TR_DESC *t,
+    const char *msg
+  )
+  {
+    flockfile(stderr);
+    (void) tr_print_error(t,msg);
+    funlockfile(stderr);
+  }
+
+/*
+  print error message which is not for a particular place in a file
+*/
+static void print_error
+  (
+    smac_job *job,
+    const char *msg
+  )
+  {
+    if (job->label != (const char *) 0)
+      fprintf(stderr,"%s: %s\n",job->label,msg);
+    else
+      fprintf(stderr,"%s\n",msg);
+  }
 
 /*
   function to open a (traced) file
 */
 static const char *open_input
   (
+    smac_job *job,
     const char *fname
   )
   {
-    if (input_desc_idx == MAX_INCLUDE_NEST)
+    if (job->input_desc_idx == MAX_INCLUDE_NEST)
       return("too many nested include files");
 
-    input_desc_idx++;
+    job->input_desc_idx++;
 
     if (strcmp(fname,"-") == 0)
       {
-        if (tr_open((input_desc + input_desc_idx),(const char *) 0) !=
-            S_TR_GOOD)
+        if (tr_open((job->input_desc + job->input_desc_idx),
+                    (const char *) 0) != S_TR_GOOD)
           {
-            input_desc_idx--;
+            job->input_desc_idx--;
             return("error accessing standard input");
           }
       }
     else
       {
-        if (tr_open((input_desc + input_desc_idx),fname) != S_TR_GOOD)
+        if (tr_open((job->input_desc + job->input_desc_idx),fname) !=
+            S_TR_GOOD)
           {
-            input_desc_idx--;
+            job->input_desc_idx--;
             return("error opening file");
           }
       }
@@ -82,6 +151,7 @@ static const char *open_input
 */
 static const char *bi_include
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -89,49 +159,149 @@ static const char *bi_include
     if (n_arg != 2)
       return("include macro requires exactly 1 argument");
 
-    return(open_input(arg[1]));
+    return(open_input(static_cast<smac_job *>(mcr_user_data(ctx)),arg[1]));
+  }
+
+
+/*
+  get file descriptor for an output file, opening it if it is not
+  kept open by the job.  the file is opened for appending, so when
+  it is emptied, writing starts over at its beginning.
+*/
+static const char *get_out_file
+  (
+    smac_job *job,
+    /* name of file */
+    const char *filename,
+    /* if non-zero, output is appended to the file, otherwise the
+       file is emptied */
+    int append,
+    /* variable to put file descriptor into */
+    int *fd
+  )
+  {
+    out_file *f,*lru = (out_file *) 0;
+    out_file nf;
+
+
+    job->n_out_switch++;
+
+    for (out_file &o : job->out_files)
+      if (o.name == filename)
+        {
+          o.last_use = job->n_out_switch;
+          /* truncation fails for files which are not regular, opening
+             them with O_TRUNC would not have emptied them either */
+          if (!append && (ftruncate(o.fd,0) != 0) && (errno != EINVAL))
+            return("error emptying output file");
+          if (!append)
+            tr_truncated();
+          *fd = o.fd;
+
+          return((const char *) 0);
+        }
+      else if ((lru == (out_file *) 0) || (o.last_use < lru->last_use))
+        lru = &o;
+
+    if (job->out_files.size() >= max_out_files)
+      {
+        /* the current output file was switched away from, so the least
+           recently used file is not in use */
+        f = lru;
+        if (close(f->fd) != 0)
+          {
+            job->out_files.erase(job->out_files.begin() +
+                                 (f - job->out_files.data()));
+            return("error closing output file");
+          }
+      }
+    else
+      {
+        job->out_files.push_back(nf);
+        f = &job->out_files.back();
+      }
+
+    f->fd = open(filename,O_WRONLY | O_CREAT | O_APPEND |
+                 (append ? 0 : O_TRUNC),0666);
+    if (f->fd < 0)
+      {
+        job->out_files.erase(job->out_files.begin() +
+                             (f - job->out_files.data()));
+        return("error opening new output file");
+      }
+    if (!append)
+      tr_truncated();
+    f->name = filename;
+    f->last_use = job->n_out_switch;
+    *fd = f->fd;
+
+    return((const char *) 0);
   }
 
+/*
+  close the output files kept open by a job
+*/
+static const char *close_out_files
+  (
+    smac_job *job
+  )
+  {
+    const char *msg = (const char *) 0;
+
+
+    for (out_file &o : job->out_files)
+      if (close(o.fd) != 0)
+        msg = "error closing output file";
+    job->out_files.clear();
 
-/* pointer to output file structure */
-static FILE *out_p;
+    return(msg);
+  }
 
 /*
   opens file for output
 */
-const char *open_output
+static const char *open_output
   (
+    Mcr_context *ctx,
     /* name of file */
     const char *filename,
-    /* mode to pass to fopen */
-    const char *mode
+    /* if non-zero, output is appended to the file */
+    int append
   )
   {
-    if ((out_p != stdout) && (out_p != (FILE *) 0))
-      /* close current output file */
-      if (fclose(out_p) < 0)
-        return("error closing current output file");
+    smac_job *job = static_cast<smac_job *>(mcr_user_data(ctx));
+    const char *p;
+
+
+    /* results so far belong to the current output file, discard any
+       more until the new one is open */
+    p = mcr_sink_func(ctx,(Mcr_sink_func) 0,(void *) 0);
+    job->out_fd = -1;
+    if (p != (const char *) 0)
+      return(p);
 
     if (filename == (const char *) 0)
-      out_p = (FILE *) 0;
-    else if (strcmp(filename,"-") == 0)
-      out_p = stdout;
+      return((const char *) 0);
+
+    if (strcmp(filename,"-") == 0)
+      job->out_fd = STDOUT_FILENO;
     else
       {
-        out_p = fopen(filename,mode);
-        if (out_p == (FILE *) 0)
-          return("error opening new output file");
+        p = get_out_file(job,filename,append,&(job->out_fd));
+        if (p != (const char *) 0)
+          return(p);
       }
 
-    return((const char *) 0);
+    return(mcr_sink_fd(ctx,job->out_fd,line_flush));
   }
 
 
 /*
   output macro
 */
-const char *bi_output
+static const char *bi_output
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -140,17 +310,18 @@ const char *bi_output
       return ("output macro requires 0 or 1 arguments");
 
     if (n_arg == 1)
-      return(open_output(((const char *) 0),((const char *) 0)));
+      return(open_output(ctx,((const char *) 0),0));
     else
-      return(open_output(arg[1],"w"));
+      return(open_output(ctx,arg[1],0));
   }
 
 
 /*
   append macro
 */
-const char *bi_append
+static const char *bi_append
   (
+    Mcr_context *ctx,
     int n_arg,
     const char **arg
   )
@@ -159,20 +330,24 @@ const char *bi_append
       return ("append macro requires 0 or 1 arguments");
 
     if (n_arg == 1)
-      return(open_output(((const char *) 0),((const char *) 0)));
+      return(open_output(ctx,((const char *) 0),0));
     else
-      return(open_output(arg[1],"a"));
+      return(open_output(ctx,arg[1],1));
   }
 
 
 /*
-  get a character, handling include levels.  returns value from
-  TR fucntions.
+  get the characters not yet read from the current line of the
+  current input file, handling include levels.  the characters
+  must be consumed with tr_skip().  returns value from TR functions.
 */
-int get_next_char
+static int get_next_span
   (
-    /* pointer to character variable to put character into */
-    char *c
+    smac_job *job,
+    /* pointer to variable to put pointer to characters into */
+    const char **s,
+    /* pointer to variable to put number of characters into */
+    int *n
   )
   {
     /* return value */
@@ -181,152 +356,434 @@ int get_next_char
 
     for ( ; ; )
       {
-        rv = tr_getc((input_desc + input_desc_idx),c);
+        rv = tr_peek((job->input_desc + job->input_desc_idx),s,n);
         if (rv == S_TR_READ)
           {
-            tr_print_error((input_desc + input_desc_idx),
+            print_tr_error((job->input_desc + job->input_desc_idx),
               "error reading input");
             return(S_TR_READ);
           }
         else if (rv == S_TR_EOF)
-	  {
-            if (input_desc_idx == 0)
+          {
+            if (job->input_desc_idx == 0)
               return(S_TR_EOF);
             else
               {
-	        rv = tr_close(input_desc + input_desc_idx);
-	        input_desc_idx--;
+                rv = tr_close(job->input_desc + job->input_desc_idx);
+                job->input_desc_idx--;
                 if (rv != S_TR_GOOD)
                   {
-                    tr_print_error((input_desc + input_desc_idx),
+                    print_tr_error((job->input_desc + job->input_desc_idx),
                       "error closing include file");
                     return(rv);
                   }
               }
-	  }
-	else
-	  /* no problems */
-	  return(S_TR_GOOD);
+          }
+        else
+          /* no problems */
+          return(S_TR_GOOD);
       }
   }
 
 
-int main
+/*
+  define the builtins which are part of the driver
+*/
+static const char *def_driver_builtins
   (
-    int argc,
-    const char **argv
+    Mcr_context *ctx
   )
   {
     const char *msg;
-    char c;
-    int rv;
 
 
-    /* define the builtin macros */
-    msg = def_builtins();
-    if (msg != (const char *) 0)
-      {
-        fprintf(stderr,"%s\n",msg);
-        return(-1);
-      }
-
     /* define include builtin */
-    msg = mcr_def("include",(void *) bi_include,0);
+    msg = mcr_def(ctx,"include",(void *) bi_include,0);
     if (msg != (const char *) 0)
-      {
-        fprintf(stderr,"%s\n",msg);
-        return(-1);
-      }
+      return(msg);
 
     /* define output builtin */
-    msg = mcr_def("output",(void *) bi_output,0);
+    msg = mcr_def(ctx,"output",(void *) bi_output,0);
     if (msg != (const char *) 0)
-      {
-        fprintf(stderr,"%s\n",msg);
-        return(-1);
-      }
+      return(msg);
 
     /* define append builtin */
-    msg = mcr_def("append",(void *) bi_append,0);
-    if (msg != (const char *) 0)
-      {
-        fprintf(stderr,"%s\n",msg);
-        return(-1);
-      }
+    return(mcr_def(ctx,"append",(void *) bi_append,0));
+  }
 
-    /* output goes to standard output by default */
-    out_p = stdout;
 
-    /* process input file */
-    input_desc_idx = -1;
-    if (argc > 1)
-      msg = open_input(argv[1]);
-    else
-      msg = open_input("-");
+/*
+  expand a primary input file in a context.  returns 0 for success,
+  -1 for failure (after printing a message).
+*/
+static int expand_file
+  (
+    Mcr_context *ctx,
+    /* name of input file, - for standard input */
+    const char *in_name,
+    /* name of initial output file, - for standard output, null to
+       discard output */
+    const char *out_name,
+    /* name to put in front of error messages, or null */
+    const char *label,
+    /* top level arguments */
+    int n_arg,
+    const char **arg
+  )
+  {
+    const char *msg,*s;
+    int n,rv;
+    size_t n_used;
+    /* input file span was taken from */
+    TR_DESC *t;
+    std::unique_ptr<smac_job> job(new smac_job);
+
+
+    job->input_desc_idx = -1;
+    job->out_fd = -1;
+    job->n_out_switch = 0;
+    job->label = label;
+    mcr_set_user_data(ctx,job.get());
+
+    msg = open_output(ctx,out_name,0);
+    if (msg == (const char *) 0)
+      msg = open_input(job.get(),in_name);
     if (msg != (const char *) 0)
       {
-        fprintf(stderr,"%s\n",msg);
+        print_error(job.get(),msg);
+        (void) open_output(ctx,((const char *) 0),0);
+        (void) close_out_files(job.get());
         return(-1);
       }
 
-    mcr_start_expand(argc,argv);
-    mcr_result = res_buf;
-    mcr_n_result = SIZE_RES_BUF;
+    mcr_start_expand(ctx,n_arg,arg);
     for ( ; ; )
       {
-        rv = get_next_char(&c);
+        rv = get_next_span(job.get(),&s,&n);
         if (rv == S_TR_EOF)
           break;
         if (rv != S_TR_GOOD)
-          return(-1);
+          break;
+
+        /* invoked macros may change the current input file */
+        t = job->input_desc + job->input_desc_idx;
 
-        msg = mcr_next_char(c);
+        msg = mcr_next_chars(ctx,s,size_t(n),&n_used);
+        tr_skip(t,int(n_used));
         if (msg != (const char *) 0)
           {
-            tr_print_error((input_desc + input_desc_idx),msg);
-            return(-1);
+            /* output what was produced before the error */
+            (void) mcr_flush_sink(ctx);
+            print_tr_error(t,msg);
+            rv = S_TR_READ;
+            break;
           }
+      }
+
+    if ((rv == S_TR_EOF) && mcr_expanding(ctx))
+      {
+        print_tr_error((job->input_desc + 0),
+        "input ended in middle of macro expansion");
+        rv = S_TR_READ;
+      }
+
+    /* close the input files */
+    for ( ; job->input_desc_idx > 0; job->input_desc_idx--)
+      (void) tr_close(job->input_desc + job->input_desc_idx);
+    if ((tr_close(job->input_desc + 0) != S_TR_GOOD) && (rv == S_TR_EOF))
+      {
+        print_error(job.get(),"cannot close the original input file");
+        rv = S_TR_READ;
+      }
+
+    msg = open_output(ctx,((const char *) 0),0);
+    if (msg == (const char *) 0)
+      msg = close_out_files(job.get());
+    else
+      (void) close_out_files(job.get());
+    if ((msg != (const char *) 0) && (rv == S_TR_EOF))
+      {
+        print_error(job.get(),msg);
+        rv = S_TR_READ;
+      }
+
+    mcr_set_user_data(ctx,(void *) 0);
+
+    return((rv == S_TR_EOF) ? 0 : -1);
+  }
+
+
+/* job of batch mode */
+struct batch_job
+  {
+    /* input file name, output file name, then arguments */
+    std::vector<std::string> word;
+    /* line of manifest the job is on */
+    int line_no;
+  };
+
+/*
+  read manifest for batch mode.  each line which is not empty and does
+  not begin with # gives the input file name, output file name, and
+  the arguments of a job, separated by white space.
+*/
+static const char *read_manifest
+  (
+    const char *fname,
+    std::vector<batch_job> &jobs
+  )
+  {
+    FILE *f = (strcmp(fname,"-") == 0) ? stdin : fopen(fname,"r");
+    batch_job job;
+    std::string w;
+    int c;
+
+
+    if (f == (FILE *) 0)
+      return("error opening manifest");
 
-        if (mcr_result > res_buf)
-          /* print result */
+    job.line_no = 1;
+    do
+      {
+        c = getc(f);
+
+        if ((c == ' ') || (c == '\t') || (c == '\n') || (c == EOF))
           {
-            if (out_p != (FILE *) 0)
+            if (!w.empty())
+              {
+                job.word.push_back(w);
+                w.clear();
+              }
+            if ((c == '\n') || (c == EOF))
               {
-                /* terminate result string */
-                *mcr_result = (char) '\0';
-                if (fputs(res_buf,out_p) == EOF)
+                if (job.word.size() == 1)
                   {
-                    fprintf(stderr,"error writing to output\n");
-                    return(-1);
+                    fprintf(stderr,"line %d of %s: no output file\n",
+                            job.line_no,fname);
+                    if (f != stdin)
+                      fclose(f);
+                    return("error in manifest");
                   }
+                if (!job.word.empty())
+                  jobs.push_back(job);
+                job.word.clear();
+                job.line_no++;
               }
-
-            /* reset result buffer */
-            mcr_result = res_buf;
-            mcr_n_result = SIZE_RES_BUF;
           }
+        else if ((c == '#') && w.empty() && job.word.empty())
+          {
+            /* comment */
+            do
+              c = getc(f);
+            while ((c != '\n') && (c != EOF));
+            if (c != EOF)
+              job.line_no++;
+          }
+        else
+          w += (char) c;
       }
+    while (c != EOF);
 
-    if (mcr_expanding())
+    if (ferror(f))
       {
-        tr_print_error((input_desc + 0),
-        "input ended in middle of macro expansion");
-        return(-1);
+        if (f != stdin)
+          fclose(f);
+        return("error reading manifest");
       }
 
-    if (tr_close(input_desc + 0) != S_TR_GOOD)
+    if ((f != stdin) && (fclose(f) != 0))
+      return("error closing manifest");
+
+    return((const char *) 0);
+  }
+
+/*
+  run the jobs of a manifest on a number of threads.  each job is
+  expanded in its own context, derived from base.  returns 0 if all
+  succeed, -1 otherwise.
+*/
+static int run_batch
+  (
+    const Mcr_context *base,
+    const std::vector<batch_job> &jobs,
+    unsigned int n_thread,
+    /* name of the command */
+    const char *cmd
+  )
+  {
+    /* index of next job to run */
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> pool;
+
+
+    auto worker =
+      [&]()
+        {
+          size_t i;
+
+          while ((i = next++) < jobs.size())
+            {
+              const batch_job &j = jobs[i];
+              std::vector<const char *> arg;
+              Mcr_context *ctx = mcr_new_derived_context(base);
+
+              /* top level arguments are the command, the input file,
+                 then the arguments of the job */
+              arg.push_back(cmd);
+              arg.push_back(j.word[0].c_str());
+              for (size_t k = 2; k < j.word.size(); k++)
+                arg.push_back(j.word[k].c_str());
+
+              if (expand_file(ctx,j.word[0].c_str(),j.word[1].c_str(),
+                              j.word[0].c_str(),int(arg.size()),
+                              arg.data()) != 0)
+                failed = true;
+
+              mcr_delete_context(ctx);
+            }
+        };
+
+    if (n_thread > jobs.size())
+      n_thread = (unsigned int) jobs.size();
+
+    for (unsigned int t = 1; t < n_thread; t++)
+      pool.push_back(std::thread(worker));
+
+    /* this thread is a worker too */
+    worker();
+
+    for (std::thread &th : pool)
+      th.join();
+
+    return(failed ? -1 : 0);
+  }
+
+
+int main
+  (
+    int argc,
+    const char **argv
+  )
+  {
+    const char *msg;
+    const char *prelude = (const char *) 0, *manifest = (const char *) 0;
+    unsigned int n_thread = std::thread::hardware_concurrency();
+    int i,rv;
+    Mcr_context *base,*ctx;
+    std::vector<const char *> arg;
+
+
+    /* options */
+    for (i = 1; i < argc; i++)
+      if (strcmp(argv[i],"-l") == 0)
+        line_flush = true;
+      else if ((strcmp(argv[i],"-p") != 0) && (strcmp(argv[i],"-m") != 0) &&
+               (strcmp(argv[i],"-k") != 0) && (strcmp(argv[i],"-j") != 0))
+        break;
+      else if ((i + 1) == argc)
+        {
+          fprintf(stderr,"option %s requires a value\n",argv[i]);
+          return(-1);
+        }
+      else if (strcmp(argv[i],"-p") == 0)
+        prelude = argv[++i];
+      else if (strcmp(argv[i],"-m") == 0)
+        manifest = argv[++i];
+      else if (strcmp(argv[i],"-k") == 0)
+        {
+          max_out_files = size_t(atol(argv[++i]));
+          if (max_out_files == 0)
+            {
+              fprintf(stderr,"number of output files must be positive\n");
+              return(-1);
+            }
+        }
+      else
+        /* -j */
+        {
+          n_thread = (unsigned int) atoi(argv[++i]);
+          if (n_thread == 0)
+            {
+              fprintf(stderr,"number of threads must be positive\n");
+              return(-1);
+            }
+        }
+
+    if (n_thread == 0)
+      n_thread = 1;
+
+    base = mcr_new_context();
+
+    /* define the builtin macros */
+    msg = def_builtins(base);
+    if (msg == (const char *) 0)
+      msg = def_driver_builtins(base);
+    if (msg != (const char *) 0)
       {
-        fprintf(stderr,"cannot close the original input file\n");
+        fprintf(stderr,"%s\n",msg);
         return(-1);
       }
 
-    msg = open_output(((const char *) 0),((const char *) 0));
-    if (msg != (const char *) 0)
+    /* definitions of the prelude are shared by all expansions, its
+       output is discarded */
+    if (prelude != (const char *) 0)
       {
-	fprintf(stderr,"%s\n",msg);
-        return(-1);
+        arg.push_back(argv[0]);
+        arg.push_back(prelude);
+        if (expand_file(base,prelude,(const char *) 0,(const char *) 0,
+                        int(arg.size()),arg.data()) != 0)
+          {
+            mcr_delete_context(base);
+            return(-1);
+          }
+        arg.clear();
       }
 
+    if (manifest != (const char *) 0)
+      {
+        std::vector<batch_job> jobs;
+
+        if (i < argc)
+          {
+            fprintf(stderr,"no input file allowed with manifest\n");
+            mcr_delete_context(base);
+            return(-1);
+          }
+
+        msg = read_manifest(manifest,jobs);
+        if (msg != (const char *) 0)
+          {
+            fprintf(stderr,"%s\n",msg);
+            mcr_delete_context(base);
+            return(-1);
+          }
+
+        mcr_freeze(base);
+        rv = run_batch(base,jobs,n_thread,argv[0]);
+        mcr_delete_context(base);
+
+        return(rv);
+      }
+
+    if (prelude != (const char *) 0)
+      {
+        mcr_freeze(base);
+        ctx = mcr_new_derived_context(base);
+      }
+    else
+      ctx = base;
+
+    /* process input file.  top level arguments are the command, then
+       the remaining command line arguments */
+    arg.push_back(argv[0]);
+    arg.insert(arg.end(),argv + i,argv + argc);
+    rv = expand_file(ctx,(i < argc) ? argv[i] : "-","-",(const char *) 0,
+                     int(arg.size()),arg.data());
+
+    if (ctx != base)
+      mcr_delete_context(ctx);
+    mcr_delete_context(base);
 
-    return(0);
+    return(rv);
   }
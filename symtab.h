@@ -0,0 +1,242 @@
+/*
+Copyright (c) 2016 Walter William Karas
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+  include file for the symbol table of the macro package.  names are
+  hashed with FNV-1a, a character at a time, so the hash of a name can
+  be accumulated while the name is read.  the table uses open
+  addressing with linear probing.  each entry, with the name it is
+  for, is a single allocation.  pointers to entries remain valid until
+  they are erased.
+*/
+
+#if !defined(H_SYMTAB)
+#define H_SYMTAB
+
+#include <string.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+/* hash of empty name */
+#define SYM_HASH_INIT 2166136261u
+
+/* add a character to a hash */
+inline unsigned int sym_hash_char(unsigned int h, char c)
+  {
+    return((h ^ (unsigned char) c) * 16777619u);
+  }
+
+/* hash of a name */
+inline unsigned int sym_hash(const char *name, size_t len)
+  {
+    unsigned int h = SYM_HASH_INIT;
+
+    while (len--)
+      h = sym_hash_char(h, *(name++));
+
+    return(h);
+  }
+
+template <class Value>
+class Sym_tab
+  {
+  public:
+
+    class Entry
+      {
+        friend class Sym_tab;
+
+        template <typename... Args>
+        Entry(const char *nm, size_t n, unsigned int h, Args &&... args)
+          : hash(h), len((unsigned int) n),
+            value(std::forward<Args>(args)...)
+          {
+            memcpy(name, nm, n);
+            name[n] = '\0';
+          }
+
+        ~Entry() { }
+
+        /* create entry with space for name after it */
+        template <typename... Args>
+        static Entry * create(const char *nm, size_t len, unsigned int h,
+                              Args &&... args)
+          {
+            void *mem = ::operator new(sizeof(Entry) + len);
+
+            return(new (mem) Entry(nm, len, h, std::forward<Args>(args)...));
+          }
+
+        static void destroy(Entry *e)
+          {
+            e->~Entry();
+            ::operator delete(e);
+          }
+
+      public:
+
+        const unsigned int hash;
+        /* length of name */
+        const unsigned int len;
+        Value value;
+        /* null terminated name, allocated along with the entry */
+        char name[1];
+      };
+
+  private:
+
+    /* pointers to entries, null for an empty slot.  number of slots is
+       a power of 2 */
+    std::vector<Entry *> slot_;
+
+    size_t n_entry_;
+
+    size_t mask() const { return(slot_.size() - 1); }
+
+    /* index of slot for entry, or of empty slot where it belongs */
+    size_t probe(const char *name, size_t len, unsigned int h) const
+      {
+        size_t i = h & mask();
+
+        for ( ; ; i = (i + 1) & mask())
+          {
+            const Entry *e = slot_[i];
+
+            if (!e)
+              break;
+
+            if ((e->hash == h) && (e->len == len) &&
+                (memcmp(e->name, name, len) == 0))
+              break;
+          }
+
+        return(i);
+      }
+
+    void grow()
+      {
+        std::vector<Entry *> old(slot_.size() * 2, nullptr);
+
+        old.swap(slot_);
+
+        for (Entry *e : old)
+          if (e)
+            {
+              size_t i = e->hash & mask();
+
+              while (slot_[i])
+                i = (i + 1) & mask();
+
+              slot_[i] = e;
+            }
+      }
+
+  public:
+
+    Sym_tab() : slot_(64, nullptr), n_entry_(0) { }
+
+    ~Sym_tab()
+      {
+        for (Entry *e : slot_)
+          if (e)
+            Entry::destroy(e);
+      }
+
+    Sym_tab(const Sym_tab &) = delete;
+
+    void operator = (const Sym_tab &) = delete;
+
+    /* returns null if there is no entry for the name */
+    Entry * find(const char *name, size_t len, unsigned int h) const
+      {
+        return(slot_[probe(name, len, h)]);
+      }
+
+    Entry * find(const char *name) const
+      {
+        size_t len = strlen(name);
+
+        return(find(name, len, sym_hash(name, len)));
+      }
+
+    /* add entry for name, which must not already have one.  the
+       remaining arguments are passed to the constructor of the value */
+    template <typename... Args>
+    Entry * insert(const char *name, size_t len, unsigned int h,
+                   Args &&... args)
+      {
+        /* keep table at most half full */
+        if ((2 * (n_entry_ + 1)) > slot_.size())
+          grow();
+
+        Entry *&e = slot_[probe(name, len, h)];
+
+        e = Entry::create(name, len, h, std::forward<Args>(args)...);
+        n_entry_++;
+
+        return(e);
+      }
+
+    void erase(Entry *e)
+      {
+        size_t i = probe(e->name, e->len, e->hash);
+        size_t j = i;
+
+        Entry::destroy(e);
+        n_entry_--;
+
+        /* move following entries in the run of full slots back, so
+           that none is separated from its home slot by an empty one */
+        for ( ; ; )
+          {
+            slot_[i] = nullptr;
+
+            for ( ; ; )
+              {
+                j = (j + 1) & mask();
+
+                if (!slot_[j])
+                  return;
+
+                size_t home = slot_[j]->hash & mask();
+
+                /* can slot j's entry move back to i? only if its home
+                   is not cyclically in (i, j] */
+                if (((j > i) && ((home <= i) || (home > j))) ||
+                    ((j < i) && ((home <= i) && (home > j))))
+                  break;
+              }
+
+            slot_[i] = slot_[j];
+            i = j;
+          }
+      }
+
+    /* call f for each entry */
+    template <typename Func>
+    void for_each(Func f) const
+      {
+        for (const Entry *e : slot_)
+          if (e)
+            f(*e);
+      }
+  };
+
+#endif
@@ -16,16 +16,727 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
-
 /*
   functions for reading a file and tracking the last
   character read, and to print an error message indicating
   last character read before error.
 */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "trfile.h"
+#include "scan.h"
+
+/* size of blocks a stream is read in */
+#define TR_BLOCK_SIZE 64*1024
+/* number of blocks in ring of a reader.  one is being processed while
+   the others are filled */
+#define TR_N_BLOCK 4
+/* maximum number of characters of a line kept from blocks that have
+   been processed, to print in error messages */
+#define TR_MAX_PARTIAL 4*1024
+/* number of mappings in the cache of mapped files above which those
+   not in use are removed */
+#define TR_CACHE_SIZE 64
+
+/* block of a stream */
+struct tr_block
+  {
+    std::unique_ptr<char []> buf;
+    /* number of characters read into it */
+    size_t len;
+  };
+
+/* reader of a stream.  the reader thread fills blocks in the ring
+   while the processing thread processes the one before them */
+struct tr_reader
+  {
+    /* file descriptor of stream */
+    int fd;
+    /* true if the descriptor is closed when reading ends */
+    bool own_fd;
+
+    /* protects the members following it */
+    std::mutex mutex;
+    /* signalled when a block is filled or released, or reading ends
+       or is to stop */
+    std::condition_variable cond;
+    /* ring of blocks */
+    tr_block block[TR_N_BLOCK];
+    /* index of first full block, which is being processed if
+       have_block is true */
+    unsigned int head;
+    /* number of full blocks, including one being processed */
+    unsigned int n_full;
+    /* set when end of file is reached */
+    bool eof;
+    /* set when a read fails */
+    bool error;
+    /* set when the processing thread is done with the stream */
+    bool stop;
+    /* number of threads using the reader, it is deleted by the last */
+    int n_user;
+
+    /* members used only by the processing thread */
+
+    /* true if the block at head is being processed */
+    bool have_block;
+    /* number of end-of-lines in blocks already processed */
+    size_t n_line;
+    /* text of the line in progress at the end of the blocks already
+       processed, possibly truncated at the start */
+    std::string partial;
+    /* descriptors reading the stream, innermost last.  a descriptor
+       opened on a stream that is already being read continues from
+       where the one before it is when it is first read (the one before
+       may not have consumed the characters that opened it yet), and
+       when it is closed, the one before it continues from where it
+       stopped */
+    std::vector<TR_DESC *> desc;
+  };
+
+/* protects the table of readers of shared descriptors */
+static std::mutex reader_mutex;
+
+/* readers of descriptors not opened by name (the standard input), so
+   that there is one reader for each, however many times it is opened
+   by a thread (by nested includes).  otherwise the readers would split
+   the input between them.  keyed by the descriptor and the thread
+   reading it */
+static std::map<std::pair<int,std::thread::id>,tr_reader *> shared_reader;
+
+
+/* mapping of a regular file into memory */
+struct tr_mapping
+  {
+    /* contents of file */
+    const char *text;
+    /* size of file */
+    size_t len;
+    /* descriptor of file, kept open to check that the file has not been
+       truncated, since reading the mapping beyond the end of the file
+       raises SIGBUS */
+    int fd;
+    /* times the file was last modified, and its status was last
+       changed (by any change to it, including of its permissions).  the
+       mapping is only used again if they are the same */
+    struct timespec mtime,ctime;
+    /* number of descriptors using the mapping, plus one while it is
+       in the cache.  it is unmapped when this becomes 0 */
+    int n_user;
+  };
+
+/* number of times files have been truncated by the process, when
+   tr_truncated() was called */
+static std::atomic<unsigned long int> n_truncated(0);
+
+/* number of pages of mappings read beyond the end of their files,
+   after the files were truncated by other processes.  counted by the
+   handler of SIGBUS, which maps a page of zero bytes in place of each */
+static std::atomic<unsigned long int> n_faulted(0);
+
+/* size of a page of memory */
+static size_t page_size;
+
+/* for installing the handler of SIGBUS once */
+static std::once_flag bus_once;
+
+/* protects the cache, and the counts of users of the mappings */
+static std::mutex map_mutex;
+
+/* cache of mapped files, keyed by the device and inode number of the
+   file, so the same file reached by different names has one entry.
+   it is shared by all threads */
+static struct tr_map_cache : std::map<std::pair<dev_t,ino_t>,tr_mapping *>
+  {
+    /* the cache's uses of the mappings are dropped at exit */
+    ~tr_map_cache();
+  }
+map_cache;
+
+
+/*
+  handler of SIGBUS, which is raised when a page of a mapping beyond
+  the end of its file is read.  the page is replaced by zero bytes, so
+  the read can continue, and the fault is counted, so the descriptor
+  of the file reports an error before any more of it is gotten
+*/
+static void bus_handler
+  (
+    int sig,
+    siginfo_t *info,
+    void *
+  )
+  {
+    void *page;
+
+
+    if (info->si_code == BUS_ADRERR)
+      {
+        page = (void *) (uintptr_t(info->si_addr) &
+                         ~uintptr_t(page_size - 1));
+        if (mmap(page,page_size,PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,-1,0) != MAP_FAILED)
+          {
+            n_faulted++;
+            return;
+          }
+      }
+
+    /* some other fault.  the default action is taken when the access
+       is done again */
+    (void) signal(sig,SIG_DFL);
+  }
+
+/*
+  install the handler of SIGBUS
+*/
+static void install_bus_handler(void)
+  {
+    struct sigaction sa;
+
+
+    page_size = size_t(sysconf(_SC_PAGESIZE));
+
+    memset(&sa,0,sizeof(sa));
+    sa.sa_sigaction = bus_handler;
+    sa.sa_flags = SA_SIGINFO;
+    (void) sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGBUS,&sa,(struct sigaction *) 0);
+  }
+
+
+/*
+  drop a use of a mapping, unmapping it if it is the last.  the
+  caller must hold map_mutex.  returns S_TR_GOOD or S_TR_CLOSE.
+*/
+static int release_mapping
+  (
+    tr_mapping *m
+  )
+  {
+    int rv = S_TR_GOOD;
+
+
+    if (--(m->n_user) == 0)
+      {
+        if (munmap(const_cast<char *>(m->text),m->len) != 0)
+          rv = S_TR_CLOSE;
+        if (close(m->fd) != 0)
+          rv = S_TR_CLOSE;
+        delete m;
+      }
+
+    return(rv);
+  }
+
+
+tr_map_cache::~tr_map_cache()
+  {
+    std::lock_guard<std::mutex> lock(map_mutex);
+
+    for (auto &e : *this)
+      (void) release_mapping(e.second);
+  }
+
+
+/*
+  compare times of a file
+*/
+static bool same_time
+  (
+    const struct timespec &a,
+    const struct timespec &b
+  )
+  {
+    return((a.tv_sec == b.tv_sec) && (a.tv_nsec == b.tv_nsec));
+  }
+
+/*
+  check if a mapping is of the current contents of a file
+*/
+static bool mapping_valid
+  (
+    const tr_mapping *m,
+    const struct stat &st
+  )
+  {
+    return((m->len == size_t(st.st_size)) &&
+           same_time(m->mtime,st.st_mtim) && same_time(m->ctime,st.st_ctim));
+  }
+
+
+/*
+  look for a mapping of a file in the cache.  if one is found, a use
+  of it is added.
+*/
+static tr_mapping *find_mapping
+  (
+    const struct stat &st
+  )
+  {
+    std::lock_guard<std::mutex> lock(map_mutex);
+    auto i = map_cache.find(std::make_pair(st.st_dev,st.st_ino));
+
+
+    if ((i == map_cache.end()) || !mapping_valid(i->second,st))
+      return((tr_mapping *) 0);
+
+    i->second->n_user++;
+
+    return(i->second);
+  }
+
+
+/*
+  put a new mapping of a file into the cache, replacing any mapping of
+  an earlier version of the file
+*/
+static void cache_mapping
+  (
+    tr_mapping *m,
+    const struct stat &st
+  )
+  {
+    std::lock_guard<std::mutex> lock(map_mutex);
+    auto key = std::make_pair(st.st_dev,st.st_ino);
+    auto i = map_cache.find(key);
+
+
+    if (i != map_cache.end())
+      {
+        (void) release_mapping(i->second);
+        map_cache.erase(i);
+      }
+    else if (map_cache.size() >= TR_CACHE_SIZE)
+      {
+        /* make room, by removing the mappings no descriptor is using */
+        for (i = map_cache.begin(); i != map_cache.end(); )
+          {
+            if (i->second->n_user == 1)
+              {
+                (void) release_mapping(i->second);
+                i = map_cache.erase(i);
+              }
+            else
+              ++i;
+          }
+      }
+
+    m->n_user++;
+    map_cache[key] = m;
+  }
+
+
+/*
+  drop a use of a reader, deleting it if it is the last
+*/
+static void release_reader
+  (
+    tr_reader *r
+  )
+  {
+    bool last;
+
+
+    {
+      std::lock_guard<std::mutex> lock(r->mutex);
+
+      last = (--(r->n_user) == 0);
+    }
+
+    if (last)
+      delete r;
+  }
+
+/*
+  function run by reader thread
+*/
+static void read_stream
+  (
+    tr_reader *r
+  )
+  {
+    std::unique_lock<std::mutex> lock(r->mutex);
+    tr_block *b;
+    ssize_t n;
+
+
+    for ( ; ; )
+      {
+        while ((r->n_full == TR_N_BLOCK) && !r->stop)
+          r->cond.wait(lock);
+        if (r->stop)
+          break;
+
+        b = r->block + ((r->head + r->n_full) % TR_N_BLOCK);
+        lock.unlock();
+
+        /* a block holds whatever one read returns, so that for an
+           interactive stream, lines are processed as they arrive */
+        do
+          n = read(r->fd,b->buf.get(),TR_BLOCK_SIZE);
+        while ((n < 0) && (errno == EINTR));
+
+        lock.lock();
+        if (n <= 0)
+          {
+            if (n == 0)
+              r->eof = true;
+            else
+              r->error = true;
+            r->cond.notify_one();
+            break;
+          }
+
+        b->len = size_t(n);
+        r->n_full++;
+        r->cond.notify_one();
+      }
+
+    lock.unlock();
+
+    if (r->own_fd)
+      (void) close(r->fd);
+
+    release_reader(r);
+  }
+
+/*
+  start reader for a stream.  returns S_TR_GOOD or S_TR_OPEN.
+*/
+static int start_reader
+  (
+    TR_DESC *t,
+    int fd,
+    bool own_fd
+  )
+  {
+    tr_reader *r = new tr_reader;
+
+
+    r->fd = fd;
+    r->own_fd = own_fd;
+    for (tr_block &b : r->block)
+      {
+        b.buf.reset(new char [TR_BLOCK_SIZE]);
+        b.len = 0;
+      }
+    r->head = 0;
+    r->n_full = 0;
+    r->eof = false;
+    r->error = false;
+    r->stop = false;
+    r->n_user = 2;
+    r->have_block = false;
+    r->n_line = 0;
+
+    try
+      {
+        std::thread(read_stream,r).detach();
+      }
+    catch (...)
+      {
+        delete r;
+        return(S_TR_OPEN);
+      }
+
+    t->text = (const char *) 0;
+    t->len = 0;
+    t->pos = 0;
+    t->reader = r;
+
+    return(S_TR_GOOD);
+  }
+
+/*
+  start reading a descriptor which is not closed when reading ends,
+  using its reader if it is already being read.  returns S_TR_GOOD or
+  S_TR_OPEN.
+*/
+static int share_reader
+  (
+    TR_DESC *t,
+    int fd
+  )
+  {
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    auto key = std::make_pair(fd,std::this_thread::get_id());
+    auto i = shared_reader.find(key);
+    tr_reader *r;
+
+
+    if (i == shared_reader.end())
+      {
+        if (start_reader(t,fd,false) != S_TR_GOOD)
+          return(S_TR_OPEN);
+
+        t->reader->desc.push_back(t);
+        shared_reader[key] = t->reader;
+
+        return(S_TR_GOOD);
+      }
+
+    r = i->second;
+    t->text = (const char *) 0;
+    t->len = 0;
+    t->pos = 0;
+    t->reader = r;
+    r->desc.push_back(t);
+
+    {
+      std::lock_guard<std::mutex> r_lock(r->mutex);
+
+      r->n_user++;
+    }
+
+    return(S_TR_GOOD);
+  }
+
+/*
+  when a descriptor sharing a reader is first read, take the position
+  of the one before it
+*/
+static void join_reader
+  (
+    TR_DESC *t
+  )
+  {
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    const TR_DESC *before;
+
+
+    if (t->reader->desc.front() == t)
+      return;
+
+    before = *(t->reader->desc.end() - 2);
+    t->text = before->text;
+    t->len = before->len;
+    t->pos = before->pos;
+  }
+
+/*
+  stop using the reader of a descriptor opened by share_reader().
+  returns true if it is still used by other descriptors.
+*/
+static bool unshare_reader
+  (
+    TR_DESC *t
+  )
+  {
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    tr_reader *r = t->reader;
+    TR_DESC *last;
+
+
+    r->desc.pop_back();
+    if (r->desc.empty())
+      {
+        /* descriptors are closed by the thread that opened them */
+        shared_reader.erase(std::make_pair(r->fd,
+                                           std::this_thread::get_id()));
+
+        return(false);
+      }
+
+    /* the one before continues from here */
+    last = r->desc.back();
+    last->text = t->text;
+    last->len = t->len;
+    last->pos = t->pos;
+
+    return(true);
+  }
+
+/*
+  go to the next block of a stream, waiting for it to be read.  the
+  block processed before is kept until there is another, so its text
+  is available for error messages.  returns S_TR_GOOD, S_TR_EOF or
+  S_TR_READ.
+*/
+static int next_block
+  (
+    TR_DESC *t
+  )
+  {
+    tr_reader *r = t->reader;
+    std::unique_lock<std::mutex> lock(r->mutex);
+    const unsigned int need = r->have_block ? 2 : 1;
+    const char *p,*nl;
+
+
+    while ((r->n_full < need) && !r->eof && !r->error)
+      r->cond.wait(lock);
+
+    if (r->n_full < need)
+      return(r->error ? S_TR_READ : S_TR_EOF);
+
+    if (r->have_block)
+      {
+        /* keep track of the lines of the block being released */
+        p = t->text;
+        r->n_line += scan_count(p,p + t->len,(char) '\n');
+        nl = p + t->len;
+        while ((nl != p) && (nl[-1] != (char) '\n'))
+          nl--;
+        if (nl != p)
+          r->partial.clear();
+        r->partial.append(nl,size_t((p + t->len) - nl));
+        if (r->partial.size() > TR_MAX_PARTIAL)
+          r->partial.erase(0,r->partial.size() - TR_MAX_PARTIAL);
+
+        r->head = (r->head + 1) % TR_N_BLOCK;
+        r->n_full--;
+        r->cond.notify_one();
+      }
+
+    r->have_block = true;
+    t->text = r->block[r->head].buf.get();
+    t->len = r->block[r->head].len;
+    t->pos = 0;
+
+    return(S_TR_GOOD);
+  }
+
+
+/*
+  if a file has been truncated by the process, or a mapping has been
+  read beyond the end of its file, since the size of a mapped file was
+  last checked, check it again.  if the file is shorter, its text ends
+  at its new size, so the part of the mapping beyond the end of the
+  file is not read.  if a mapping was read beyond the end of its file,
+  the zero bytes read may have been this file's, so that is an error.
+  returns S_TR_GOOD or S_TR_READ.
+*/
+static int check_size
+  (
+    TR_DESC *t
+  )
+  {
+    unsigned long int n = n_truncated.load(), f = n_faulted.load();
+    struct stat st;
+    int rv = S_TR_GOOD;
+
+
+    if ((t->mapping == (tr_mapping *) 0) ||
+        ((t->n_checked == n) && (t->n_faulted == f)))
+      return(S_TR_GOOD);
+
+    if ((fstat(t->mapping->fd,&st) == 0) && (size_t(st.st_size) < t->len))
+      {
+        if (t->n_faulted != f)
+          rv = S_TR_READ;
+
+        t->len = size_t(st.st_size);
+        if (t->pos > t->len)
+          t->pos = t->len;
+      }
+
+    t->n_checked = n;
+    t->n_faulted = f;
+
+    return(rv);
+  }
+
+
+/*
+  open a file, mapping it into memory if it is a regular file, and
+  otherwise starting a reader for it.  returns S_TR_GOOD or S_TR_OPEN.
+*/
+static int open_file
+  (
+    TR_DESC *t,
+    const char *fn
+  )
+  {
+    struct stat st;
+    int fd;
+    void *m;
+    tr_mapping *mp;
+
+
+    t->pos = 0;
+    t->reader = (tr_reader *) 0;
+    t->mapping = (tr_mapping *) 0;
+    /* a truncation after this is found when the size is checked */
+    t->n_checked = n_truncated.load();
+    t->n_faulted = n_faulted.load();
+
+    /* a file in the cache is used without opening it */
+    if ((stat(fn,&st) == 0) && S_ISREG(st.st_mode) &&
+        ((mp = find_mapping(st)) != (tr_mapping *) 0))
+      {
+        t->text = mp->text;
+        t->len = mp->len;
+        t->mapping = mp;
+
+        return(S_TR_GOOD);
+      }
+
+    fd = open(fn,O_RDONLY);
+    if (fd < 0)
+      return(S_TR_OPEN);
+
+    if ((fstat(fd,&st) == 0) && S_ISREG(st.st_mode))
+      {
+        t->len = size_t(st.st_size);
+
+        if (t->len == 0)
+          {
+            /* an empty file cannot be mapped */
+            t->text = "";
+            (void) close(fd);
+
+            return(S_TR_GOOD);
+          }
+
+        std::call_once(bus_once,install_bus_handler);
+
+        m = mmap((void *) 0,t->len,PROT_READ,MAP_PRIVATE,fd,0);
+        if (m != MAP_FAILED)
+          {
+            (void) madvise(m,t->len,MADV_SEQUENTIAL);
+            t->text = static_cast<const char *>(m);
+
+            mp = new tr_mapping;
+            mp->text = t->text;
+            mp->len = t->len;
+            mp->fd = fd;
+            mp->mtime = st.st_mtim;
+            mp->ctime = st.st_ctim;
+            mp->n_user = 1;
+            cache_mapping(mp,st);
+            t->mapping = mp;
+
+            return(S_TR_GOOD);
+          }
+      }
+
+    if (start_reader(t,fd,true) != S_TR_GOOD)
+      {
+        (void) close(fd);
+        return(S_TR_OPEN);
+      }
+
+    return(S_TR_GOOD);
+  }
 
 
 /*
@@ -42,15 +753,17 @@ int tr_open
   {
     if (fn == (const char *) 0)
       {
-        t->file_p = stdin;
+        t->mapping = (tr_mapping *) 0;
+        if (share_reader(t,fileno(stdin)) != S_TR_GOOD)
+          return(S_TR_OPEN);
+
         /* save file name */
         (void) strcpy(t->file_name,"standard input");
       }
     else
       {
         /* open file for reading */
-        t->file_p = fopen(fn,"r");
-        if (t->file_p == (FILE *) 0)
+        if (open_file(t,fn) != S_TR_GOOD)
           return(S_TR_OPEN);
 
         /* save file name */
@@ -59,13 +772,6 @@ int tr_open
         (t->file_name)[TR_MAX_LEN_FILE_NAME] = (char) '\0';
       }
 
-    /* reset counters */
-    t->line_no = 1;
-    t->char_no = 0;
-
-    /* create empty buffer: will trigger a read */
-    (t->line)[0] = (char) '\0';
-
     return(S_TR_GOOD);
   }
 
@@ -81,27 +787,77 @@ int tr_getc
     char *c
   )
   {
-    while ((t->line)[t->char_no] == (char) '\0')
+    const char *s;
+    int n,rv;
+
+
+    rv = tr_peek(t,&s,&n);
+    if (rv != S_TR_GOOD)
+      return(rv);
+
+    *c = *s;
+    (t->pos)++;
+
+    return(S_TR_GOOD);
+  }
+
+/*
+  function to get characters not yet read from the file, without
+  consuming them.
+*/
+int tr_peek
+  (
+    /* pointer to descriptor for file */
+    TR_DESC *t,
+    /* variable to put pointer to characters into */
+    const char **s,
+    /* variable to put number of characters into */
+    int *n
+  )
+  {
+    int rv;
+
+
+    rv = check_size(t);
+    if (rv != S_TR_GOOD)
+      return(rv);
+
+    if ((t->text == (const char *) 0) && (t->reader != (tr_reader *) 0) &&
+        !t->reader->own_fd)
+      join_reader(t);
+
+    while (t->pos == t->len)
       {
-        if (fgets(t->line,(TR_MAX_LEN_LINE + 2),t->file_p)
-              == (char *) 0)
-          {
-            if (feof(t->file_p))
-              return(S_TR_EOF);
-            else
-              return(S_TR_READ);
-          }
+        if (t->reader == (tr_reader *) 0)
+          return(S_TR_EOF);
 
-        t->char_no = 0;
+        rv = next_block(t);
+        if (rv != S_TR_GOOD)
+          return(rv);
       }
 
-    *c = (t->line)[(t->char_no)++];
-    if (*c == (char) '\n')
-      (t->line_no)++;
+    *s = t->text + t->pos;
+    *n = ((t->len - t->pos) > size_t(INT_MAX)) ?
+         INT_MAX : int(t->len - t->pos);
 
     return(S_TR_GOOD);
   }
 
+
+/*
+  function to consume characters obtained with tr_peek.
+*/
+void tr_skip
+  (
+    /* pointer to descriptor for file */
+    TR_DESC *t,
+    /* number of characters to consume */
+    int n
+  )
+  {
+    t->pos += size_t(n);
+  }
+
 /*
   function to print error message along with number
   of current line, text of current line, pointer to
@@ -115,31 +871,89 @@ int tr_print_error
     const char *e_msg
   )
   {
-    int i;
+    const char *text,*end,*last,*start,*line_end;
+    /* part of the line in blocks already processed */
+    const std::string *partial = (const std::string *) 0;
+    /* part of the line in blocks read but not yet processed */
+    std::string rest;
+    int line_no;
+    size_t col;
+    struct stat st;
 
 
-    if (fprintf(stderr,"error in line %d of %s:\n  %s\n",
-                t->line_no,t->file_name,e_msg) < 0)
-      return(S_TR_MESSAGE);
+    /* if characters were read beyond the end of a mapped file, it was
+       truncated, and they were zero bytes, which caused the error */
+    if ((t->mapping != (tr_mapping *) 0) &&
+        (fstat(t->mapping->fd,&st) == 0) && (t->pos > size_t(st.st_size)))
+      e_msg = "input file truncated while being read";
+    (void) check_size(t);
 
-    /* make sure line has end-of-line */
-    (t->line)[strlen(t->line) - 1] = (char) '\n';
+    text = (t->text != (const char *) 0) ? t->text : "";
+    end = text + t->len;
+    last = text + t->pos;
+    line_no = 1 + int(scan_count(text,last,(char) '\n'));
 
-    /* output line */
-    if (fputs(t->line,stderr) != 0)
-      return(S_TR_MESSAGE);
+    if (t->reader != (tr_reader *) 0)
+      line_no += int(t->reader->n_line);
 
-    /* output pointer to last character read */
-    (t->char_no)--;
-    for (i = 0; i < t->char_no; i++)
-      if (fputc((char) ' ',stderr) == EOF)
-        return(S_TR_MESSAGE);
-    if (fputs("^\n",stderr) != 0)
+    if (last != text)
+      last--;
+
+    /* line containing last character read */
+    start = last;
+    while ((start != text) && (start[-1] != (char) '\n'))
+      start--;
+    line_end = static_cast<const char *>(
+                 memchr(last,(char) '\n',size_t(end - last)));
+    if (line_end == (const char *) 0)
+      line_end = end;
+
+    col = size_t(last - start);
+    if ((start == text) && (t->reader != (tr_reader *) 0))
+      {
+        partial = &(t->reader->partial);
+        col += partial->size();
+      }
+
+    if ((line_end == end) && (t->reader != (tr_reader *) 0))
+      /* the line continues in the following blocks.  those that have
+         been read are not changed until they are processed.  there is
+         no waiting for more input */
+      {
+        tr_reader *r = t->reader;
+        std::lock_guard<std::mutex> lock(r->mutex);
+        const char *p,*nl;
+        unsigned int i;
+
+        for (i = 1; (i < r->n_full) && (rest.size() < TR_MAX_PARTIAL); i++)
+          {
+            const tr_block &b = r->block[(r->head + i) % TR_N_BLOCK];
+
+            p = b.buf.get();
+            nl = static_cast<const char *>(memchr(p,(char) '\n',b.len));
+            rest.append(p,nl ? size_t(nl - p) : b.len);
+            if (nl)
+              break;
+          }
+      }
+
+    if (fprintf(stderr,"error in line %d of %s:\n  %s\n%s%.*s%s\n%*s^\n",
+                line_no,t->file_name,e_msg,
+                partial ? partial->c_str() : "",
+                int(line_end - start),start,rest.c_str(),int(col),"") < 0)
       return(S_TR_MESSAGE);
 
     return(S_TR_GOOD);
   }
 
+/*
+  function to call after a file is truncated by the process
+*/
+void tr_truncated(void)
+  {
+    n_truncated++;
+  }
+
 /*
   function to close file
 */
@@ -149,9 +963,38 @@ int tr_close
     TR_DESC *t
   )
   {
-    if (t->file_p != stdin)
-      if (fclose(t->file_p) == EOF)
-        return(S_TR_CLOSE);
+    tr_reader *r = t->reader;
+
+
+    if (r != (tr_reader *) 0)
+      {
+        if (!r->own_fd && unshare_reader(t))
+          {
+            release_reader(r);
+
+            return(S_TR_GOOD);
+          }
+
+        {
+          std::lock_guard<std::mutex> lock(r->mutex);
+
+          r->stop = true;
+          r->cond.notify_one();
+        }
+
+        /* the reader thread may be waiting for input, it finishes on
+           its own */
+        release_reader(r);
+
+        return(S_TR_GOOD);
+      }
+
+    if (t->mapping != (tr_mapping *) 0)
+      {
+        std::lock_guard<std::mutex> lock(map_mutex);
+
+        return(release_mapping(t->mapping));
+      }
 
     return(S_TR_GOOD);
   }
@@ -45,22 +45,42 @@ SOFTWARE.
 
 /* maximum length of file name */
 #define TR_MAX_LEN_FILE_NAME 32
-/* maximum length of any line in file */
-#define TR_MAX_LEN_LINE 79
 
-/* descriptor for file to trace */
+/* reader of a stream, on a thread of its own */
+struct tr_reader;
+
+/* mapping of a regular file into memory, shared by all the
+   descriptors of the file */
+struct tr_mapping;
+
+/* descriptor for file to trace.  a regular file is mapped into memory
+   and read all at once.  the mapping is kept in a cache, and used
+   again when the file is opened again without having changed.  other
+   files are read in blocks by a reader thread, while the blocks read
+   before are being processed.  the standard input has one reader for
+   each thread reading it, so a nested include of it continues reading
+   where the includer is */
 typedef struct
   {
     /* storage for file name */
     char file_name[TR_MAX_LEN_FILE_NAME + 1];
-    /* stream object for file */
-    FILE *file_p;
-    /* storage for line */
-    char line[TR_MAX_LEN_LINE + 2];
-    /* number of current line (1 offset) */
-    int line_no;
-    /* number of current character in line (0 offset) */
-    int char_no;
+    /* characters being read: the contents of a mapped file, or the
+       current block of a stream */
+    const char *text;
+    /* number of characters in text */
+    size_t len;
+    /* offset in text of next character to read.  line and character
+       numbers are only found when an error message is printed */
+    size_t pos;
+    /* for a stream, its reader, otherwise null */
+    struct tr_reader *reader;
+    /* for a mapped file, its mapping, otherwise null */
+    struct tr_mapping *mapping;
+    /* for a mapped file, the number of truncations of files by the
+       process, and of reads of mappings beyond the ends of their
+       files, when its size was last checked */
+    unsigned long int n_checked;
+    unsigned long int n_faulted;
   }
 TR_DESC;
 
@@ -88,6 +108,34 @@ int tr_getc
   );
 
 
+/*
+  function to get characters not yet read from the file, without
+  consuming them.  for a mapped file, all the characters not yet read
+  are gotten, for a stream, those in the current block.
+*/
+int tr_peek
+  (
+    /* pointer to descriptor for file */
+    TR_DESC *,
+    /* variable to put pointer to characters into */
+    const char **,
+    /* variable to put number of characters into */
+    int *
+  );
+
+
+/*
+  function to consume characters obtained with tr_peek.
+*/
+void tr_skip
+  (
+    /* pointer to descriptor for file */
+    TR_DESC *,
+    /* number of characters to consume */
+    int
+  );
+
+
 /*
   function to print error message along with number
   of current line, text of current line, pointer to
@@ -102,6 +150,18 @@ int tr_print_error
   );
 
 
+/*
+  function to call after the process truncates a file (by opening it
+  for output, for example).  a mapped file being read is checked before
+  more characters are gotten from it, and if it was truncated, it ends
+  at its new size.
+*/
+void tr_truncated
+  (
+    void
+  );
+
+
 /*
   function to close file
 */